@@ -0,0 +1,387 @@
+#include "block_graph.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+
+#include "odgi/dna.hpp"
+#include "tempfile.hpp"
+
+namespace smoothxg {
+
+namespace {
+
+const uint64_t HEADER_WORDS = 6;
+
+// the pieces of a block graph before they are laid out in one buffer
+struct block_graph_parts_t {
+    std::vector<uint64_t> seq_offsets = {0};
+    std::string seqs;
+    std::vector<uint64_t> edges;
+    std::vector<uint64_t> step_offsets = {0};
+    std::vector<uint64_t> steps;
+    std::vector<uint64_t> name_offsets = {0};
+    std::string names;
+};
+
+void append_words(std::string& data, const uint64_t* words, const uint64_t& count) {
+    data.append((const char*)words, count * sizeof(uint64_t));
+}
+
+std::string assemble(const block_graph_parts_t& parts) {
+    const uint64_t header[HEADER_WORDS] = {
+        parts.seq_offsets.size() - 1,
+        parts.edges.size() / 2,
+        parts.step_offsets.size() - 1,
+        parts.steps.size(),
+        parts.seqs.size(),
+        parts.names.size()
+    };
+    std::string data;
+    data.reserve((HEADER_WORDS + parts.seq_offsets.size() + parts.edges.size() + parts.step_offsets.size()
+                  + parts.name_offsets.size() + parts.steps.size()) * sizeof(uint64_t)
+                 + parts.seqs.size() + parts.names.size());
+    append_words(data, header, HEADER_WORDS);
+    append_words(data, parts.seq_offsets.data(), parts.seq_offsets.size());
+    append_words(data, parts.edges.data(), parts.edges.size());
+    append_words(data, parts.step_offsets.data(), parts.step_offsets.size());
+    append_words(data, parts.name_offsets.data(), parts.name_offsets.size());
+    append_words(data, parts.steps.data(), parts.steps.size());
+    data.append(parts.seqs);
+    data.append(parts.names);
+    return data;
+}
+
+}
+
+block_graph_t::block_graph_t(const odgi::graph_t& graph) {
+    block_graph_parts_t parts;
+
+    const uint64_t node_count = graph.get_node_count();
+    if (node_count > 0 && (graph.min_node_id() != 1 || (uint64_t)graph.max_node_id() != node_count)) {
+        std::cerr << "[smoothxg::block_graph_t] error: block graph node ids are not compacted" << std::endl;
+        exit(1);
+    }
+    // nodes in id order
+    std::vector<handle_t> handles(node_count);
+    graph.for_each_handle([&](const handle_t& h) {
+        handles[graph.get_id(h) - 1] = h;
+    });
+    parts.seq_offsets.reserve(node_count + 1);
+    for (auto& h : handles) {
+        parts.seqs.append(graph.get_sequence(h));
+        parts.seq_offsets.push_back(parts.seqs.size());
+    }
+
+    graph.for_each_edge([&](const edge_t& edge) {
+        parts.edges.push_back(as_integer(number_bool_packing::pack(graph.get_id(edge.first), graph.get_is_reverse(edge.first))));
+        parts.edges.push_back(as_integer(number_bool_packing::pack(graph.get_id(edge.second), graph.get_is_reverse(edge.second))));
+    });
+
+    graph.for_each_path_handle([&](const path_handle_t& path) {
+        graph.for_each_step_in_path(path, [&](const step_handle_t& step) {
+            handle_t h = graph.get_handle_of_step(step);
+            parts.steps.push_back(as_integer(number_bool_packing::pack(graph.get_id(h), graph.get_is_reverse(h))));
+        });
+        parts.step_offsets.push_back(parts.steps.size());
+        parts.names.append(graph.get_path_name(path));
+        parts.name_offsets.push_back(parts.names.size());
+    });
+
+    _data = assemble(parts);
+    _index();
+}
+
+block_graph_t::block_graph_t(std::string&& data) : _data(std::move(data)) {
+    _index();
+}
+
+uint64_t block_graph_t::_word(const uint64_t& i) const {
+    // the buffer is not guaranteed to be aligned
+    uint64_t w;
+    std::memcpy(&w, _data.data() + i * sizeof(uint64_t), sizeof(uint64_t));
+    return w;
+}
+
+void block_graph_t::_index(void) {
+    if (_data.empty()) {
+        _node_count = _edge_count = _path_count = _step_count = 0;
+        return;
+    }
+    _node_count = _word(0);
+    _edge_count = _word(1);
+    _path_count = _word(2);
+    _step_count = _word(3);
+    const uint64_t seq_length = _word(4);
+    _seq_offsets = HEADER_WORDS;
+    _edges = _seq_offsets + _node_count + 1;
+    _step_offsets = _edges + 2 * _edge_count;
+    _name_offsets = _step_offsets + _path_count + 1;
+    _steps = _name_offsets + _path_count + 1;
+    _seqs = (_steps + _step_count) * sizeof(uint64_t);
+    _names = _seqs + seq_length;
+}
+
+std::string_view block_graph_t::get_sequence(const nid_t& id) const {
+    const uint64_t begin = _word(_seq_offsets + id - 1);
+    const uint64_t end = _word(_seq_offsets + id);
+    return std::string_view(_data.data() + _seqs + begin, end - begin);
+}
+
+void block_graph_t::for_each_edge(const std::function<void(const handle_t& from, const handle_t& to)>& lambda) const {
+    for (uint64_t i = 0; i < _edge_count; ++i) {
+        lambda(as_handle(_word(_edges + 2 * i)), as_handle(_word(_edges + 2 * i + 1)));
+    }
+}
+
+void block_graph_t::for_each_path_handle(const std::function<void(const path_handle_t& path)>& lambda) const {
+    for (uint64_t i = 1; i <= _path_count; ++i) {
+        lambda(as_path_handle(i));
+    }
+}
+
+std::string_view block_graph_t::get_path_name(const path_handle_t& path) const {
+    const uint64_t begin = _word(_name_offsets + as_integer(path) - 1);
+    const uint64_t end = _word(_name_offsets + as_integer(path));
+    return std::string_view(_data.data() + _names + begin, end - begin);
+}
+
+path_handle_t block_graph_t::get_path_handle(const std::string_view& name) const {
+    for (uint64_t i = 1; i <= _path_count; ++i) {
+        if (get_path_name(as_path_handle(i)) == name) {
+            return as_path_handle(i);
+        }
+    }
+    return as_path_handle(0);
+}
+
+uint64_t block_graph_t::get_step_count(const path_handle_t& path) const {
+    return _word(_step_offsets + as_integer(path)) - _word(_step_offsets + as_integer(path) - 1);
+}
+
+handle_t block_graph_t::get_handle_of_step(const path_handle_t& path, const uint64_t& rank) const {
+    return as_handle(_word(_steps + _word(_step_offsets + as_integer(path) - 1) + rank));
+}
+
+void block_graph_t::for_each_step_in_path(const path_handle_t& path,
+                                          const std::function<void(const handle_t& handle)>& lambda) const {
+    const uint64_t begin = _word(_step_offsets + as_integer(path) - 1);
+    const uint64_t end = _word(_step_offsets + as_integer(path));
+    for (uint64_t i = begin; i < end; ++i) {
+        lambda(as_handle(_word(_steps + i)));
+    }
+}
+
+block_graph_t block_graph_t::flip(const std::string& consensus_name) const {
+    block_graph_parts_t parts;
+
+    // each node is replaced by its reverse complement, so a handle of the old graph
+    // spells the same sequence as the opposite handle of the new one
+    parts.seqs.reserve(_data.size() - _seqs);
+    parts.seq_offsets.reserve(_node_count + 1);
+    for (nid_t id = 1; id <= (nid_t)_node_count; ++id) {
+        std::string seq(get_sequence(id));
+        odgi::reverse_complement_in_place(seq);
+        parts.seqs.append(seq);
+        parts.seq_offsets.push_back(parts.seqs.size());
+    }
+
+    parts.edges.reserve(2 * _edge_count);
+    for_each_edge([&](const handle_t& from, const handle_t& to) {
+        parts.edges.push_back(as_integer(number_bool_packing::toggle_bit(from)));
+        parts.edges.push_back(as_integer(number_bool_packing::toggle_bit(to)));
+    });
+
+    parts.steps.reserve(_step_count);
+    for_each_path_handle([&](const path_handle_t& path) {
+        const std::string_view name = get_path_name(path);
+        if (name != consensus_name) {
+            // flip the path, but preserving its sequence
+            for_each_step_in_path(path, [&](const handle_t& h) {
+                parts.steps.push_back(as_integer(number_bool_packing::toggle_bit(h)));
+            });
+        } else {
+            // the consensus has to be encoded in reverse complement, but it remains in the forward strand
+            const uint64_t first = parts.steps.size();
+            for_each_step_in_path(path, [&](const handle_t& h) {
+                parts.steps.push_back(as_integer(h));
+            });
+            std::reverse(parts.steps.begin() + first, parts.steps.end());
+        }
+        parts.step_offsets.push_back(parts.steps.size());
+        parts.names.append(name);
+        parts.name_offsets.push_back(parts.names.size());
+    });
+
+    return block_graph_t(assemble(parts));
+}
+
+block_steps_t::block_steps_t(const block_graph_t& block_graph) {
+    if (block_graph.get_node_count() >= ((uint64_t)1 << 31)) {
+        std::cerr << "[smoothxg::block_steps_t] error: block graph has too many nodes ("
+                  << block_graph.get_node_count() << ")" << std::endl;
+        exit(1);
+    }
+    _path_offsets.reserve(block_graph.get_path_count() + 1);
+    _path_offsets.push_back(0);
+    block_graph.for_each_path_handle([&](const path_handle_t& path) {
+        block_graph.for_each_step_in_path(path, [&](const handle_t& h) {
+            _steps.push_back((uint32_t)as_integer(h));
+        });
+        _path_offsets.push_back(_steps.size());
+    });
+}
+
+void block_steps_t::for_each_step_in_path(const path_handle_t& path,
+                                          const std::function<void(const handle_t& handle)>& lambda) const {
+    const uint64_t p = as_integer(path);
+    if (p == 0 || p >= _path_offsets.size()) {
+        return;
+    }
+    for (uint64_t i = _path_offsets[p - 1]; i < _path_offsets[p]; ++i) {
+        lambda(as_handle((uint64_t)_steps[i]));
+    }
+}
+
+block_nodes_t::block_nodes_t(const block_graph_t& block_graph, const uint64_t& id_offset) {
+    _seq_offsets.reserve(block_graph.get_node_count() + 1);
+    _seq_offsets.push_back(0);
+    for (nid_t id = 1; id <= (nid_t)block_graph.get_node_count(); ++id) {
+        _seqs.append(block_graph.get_sequence(id));
+        _seq_offsets.push_back(_seqs.size());
+    }
+    _edges.reserve(2 * block_graph.get_edge_count());
+    block_graph.for_each_edge([&](const handle_t& from, const handle_t& to) {
+        _edges.push_back(as_integer(number_bool_packing::pack(id_offset + block_graph_t::get_id(from),
+                                                              block_graph_t::get_is_reverse(from))));
+        _edges.push_back(as_integer(number_bool_packing::pack(id_offset + block_graph_t::get_id(to),
+                                                              block_graph_t::get_is_reverse(to))));
+    });
+}
+
+void block_nodes_t::add_to(odgi::graph_t& graph) const {
+    std::string seq;
+    for (uint64_t i = 0; i + 1 < _seq_offsets.size(); ++i) {
+        seq.assign(_seqs, _seq_offsets[i], _seq_offsets[i + 1] - _seq_offsets[i]);
+        graph.create_handle(seq);
+    }
+    for (uint64_t i = 0; i < _edges.size(); i += 2) {
+        const handle_t from = as_handle(_edges[i]);
+        const handle_t to = as_handle(_edges[i + 1]);
+        graph.create_edge(graph.get_handle(block_graph_t::get_id(from), block_graph_t::get_is_reverse(from)),
+                          graph.get_handle(block_graph_t::get_id(to), block_graph_t::get_is_reverse(to)));
+    }
+}
+
+block_graph_store_t::block_graph_store_t(const uint64_t& block_count, const uint64_t& max_memory)
+    : _max_memory(max_memory), _memory_used(0), _spilled(false),
+      _records(block_count), _disk_records(block_count, {0, 0}) {
+}
+
+block_graph_store_t::~block_graph_store_t() {
+    _map.reset();
+    if (!_path_tmp_block_graphs.empty()) {
+        _disk.close();
+        temp_file::remove(_path_tmp_block_graphs);
+    }
+}
+
+uint64_t block_graph_store_t::size(void) const {
+    std::shared_lock<std::shared_mutex> lock(_records_mutex);
+    return _records.size();
+}
+
+void block_graph_store_t::resize(const uint64_t& block_count) {
+    std::unique_lock<std::shared_mutex> lock(_records_mutex);
+    std::lock_guard<std::mutex> guard(_disk_mutex);
+    _records.resize(block_count);
+    _disk_records.resize(block_count, {0, 0});
+}
+
+void block_graph_store_t::put(const uint64_t& block_id, std::string&& record) {
+    std::shared_lock<std::shared_mutex> lock(_records_mutex);
+    _release(block_id);
+
+    const uint64_t length = record.size();
+    uint64_t used = _memory_used.load();
+    while (used + length <= _max_memory) {
+        if (_memory_used.compare_exchange_weak(used, used + length)) {
+            _records[block_id] = std::make_unique<std::string>(std::move(record));
+            if (spilled()) {
+                // forget any older copy on disk
+                std::lock_guard<std::mutex> guard(_disk_mutex);
+                _disk_records[block_id] = {0, 0};
+            }
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(_disk_mutex);
+    if (_path_tmp_block_graphs.empty()) {
+        _path_tmp_block_graphs = temp_file::create("block_graphs");
+        _disk.open(_path_tmp_block_graphs, std::ios::binary | std::ios::trunc);
+        _spilled.store(true);
+    }
+    _disk.write(record.data(), length);
+    // make it visible to the map before anyone asks for it
+    _disk.flush();
+    if (!_disk) {
+        std::cerr << "[smoothxg::block_graph_store_t] error: unable to write block graphs to "
+                  << _path_tmp_block_graphs << std::endl;
+        exit(1);
+    }
+    _disk_records[block_id] = {_disk_size, length};
+    _disk_size += length;
+}
+
+const char* block_graph_store_t::_map_disk_record(const uint64_t& offset, const uint64_t& length,
+                                                  std::shared_ptr<mio::mmap_source>& map) const {
+    if (!_map || _map->size() < offset + length) {
+        auto new_map = std::make_shared<mio::mmap_source>();
+        std::error_code error;
+        new_map->map(_path_tmp_block_graphs, error);
+        if (error) {
+            std::cerr << "[smoothxg::block_graph_store_t] error: unable to memory-map "
+                      << _path_tmp_block_graphs << ": " << error.message() << std::endl;
+            exit(1);
+        }
+        // readers still holding the old map keep it alive until they are done
+        _map = new_map;
+    }
+    map = _map;
+    return map->data() + offset;
+}
+
+void block_graph_store_t::get(const uint64_t& block_id, std::string& record) const {
+    std::shared_lock<std::shared_mutex> lock(_records_mutex);
+    if (_records[block_id]) {
+        record = *_records[block_id];
+        return;
+    }
+    std::shared_ptr<mio::mmap_source> map;
+    const char* data = nullptr;
+    uint64_t length = 0;
+    {
+        std::lock_guard<std::mutex> guard(_disk_mutex);
+        length = _disk_records[block_id].second;
+        if (length > 0) {
+            data = _map_disk_record(_disk_records[block_id].first, length, map);
+        }
+    }
+    record.assign(data == nullptr ? "" : data, length);
+}
+
+void block_graph_store_t::release(const uint64_t& block_id) {
+    std::shared_lock<std::shared_mutex> lock(_records_mutex);
+    _release(block_id);
+}
+
+void block_graph_store_t::_release(const uint64_t& block_id) {
+    if (_records[block_id]) {
+        _memory_used -= _records[block_id]->size();
+        _records[block_id].reset();
+    }
+}
+
+}
+
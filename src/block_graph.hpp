@@ -0,0 +1,202 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <fstream>
+#include <mio/mmap.hpp>
+
+#include <handlegraph/types.hpp>
+#include <handlegraph/util.hpp>
+
+#include "odgi/odgi.hpp"
+
+namespace smoothxg {
+
+using namespace handlegraph;
+
+/**
+ * A smoothed block graph flattened into a single buffer that is read in place.
+ * Node ids run from 1 to the node count, as they do in the POA output, and paths
+ * are numbered from 1 in the order they were created, which matches the path
+ * ranges of the block with the consensus (if any) last.
+ *
+ * layout, in 64-bit words and then bytes:
+ * node_count, edge_count, path_count, step_count, seq_length, name_length
+ * seq_offsets[node_count+1], edges[2*edge_count], step_offsets[path_count+1],
+ * name_offsets[path_count+1], steps[step_count], sequences, path names
+ *
+ * Edges and steps are stored as handles packed with number_bool_packing.
+ */
+class block_graph_t {
+public:
+    block_graph_t() = default;
+
+    /// Flatten an odgi graph whose node ids are dense from 1.
+    explicit block_graph_t(const odgi::graph_t& graph);
+
+    /// Take ownership of an encoded buffer.
+    explicit block_graph_t(std::string&& data);
+
+    /// The encoded buffer.
+    const std::string& data(void) const { return _data; }
+
+    uint64_t get_node_count(void) const { return _node_count; }
+    uint64_t get_edge_count(void) const { return _edge_count; }
+    uint64_t get_path_count(void) const { return _path_count; }
+
+    static nid_t get_id(const handle_t& handle) { return number_bool_packing::unpack_number(handle); }
+    static bool get_is_reverse(const handle_t& handle) { return number_bool_packing::unpack_bit(handle); }
+
+    /// The forward sequence of a node.
+    std::string_view get_sequence(const nid_t& id) const;
+
+    void for_each_edge(const std::function<void(const handle_t& from, const handle_t& to)>& lambda) const;
+
+    void for_each_path_handle(const std::function<void(const path_handle_t& path)>& lambda) const;
+
+    std::string_view get_path_name(const path_handle_t& path) const;
+
+    /// Find a path by name, returning the 0 handle if there is none.
+    path_handle_t get_path_handle(const std::string_view& name) const;
+
+    uint64_t get_step_count(const path_handle_t& path) const;
+
+    /// The handle at the given step of a path.
+    handle_t get_handle_of_step(const path_handle_t& path, const uint64_t& rank) const;
+
+    void for_each_step_in_path(const path_handle_t& path, const std::function<void(const handle_t& handle)>& lambda) const;
+
+    /// The same block with every node reverse complemented. Paths keep their
+    /// sequence, except the consensus, which is reverse complemented in place.
+    block_graph_t flip(const std::string& consensus_name) const;
+
+private:
+
+    uint64_t _word(const uint64_t& i) const;
+    void _index(void);
+
+    std::string _data;
+    uint64_t _node_count = 0;
+    uint64_t _edge_count = 0;
+    uint64_t _path_count = 0;
+    uint64_t _step_count = 0;
+    // word offsets of the arrays
+    uint64_t _seq_offsets = 0;
+    uint64_t _edges = 0;
+    uint64_t _step_offsets = 0;
+    uint64_t _name_offsets = 0;
+    uint64_t _steps = 0;
+    // byte offsets of the character data
+    uint64_t _seqs = 0;
+    uint64_t _names = 0;
+};
+
+/**
+ * Only the path steps of a block graph, which is all lacing needs once the
+ * nodes and edges of the block are in the output graph. Steps are packed
+ * handles over the node ids of the block, which fit in 32 bits.
+ */
+class block_steps_t {
+public:
+    block_steps_t() = default;
+
+    explicit block_steps_t(const block_graph_t& block_graph);
+
+    /// Paths without steps, including the 0 handle, visit nothing.
+    void for_each_step_in_path(const path_handle_t& path, const std::function<void(const handle_t& handle)>& lambda) const;
+
+private:
+    // steps of path p are in [_path_offsets[p-1], _path_offsets[p])
+    std::vector<uint64_t> _path_offsets;
+    std::vector<uint32_t> _steps;
+};
+
+/**
+ * The nodes and edges of a block graph, with its node ids shifted into those of
+ * the output graph, so that adding them there is a plain serial loop over flat
+ * arrays. Edges are handles packed with number_bool_packing.
+ */
+class block_nodes_t {
+public:
+    block_nodes_t() = default;
+
+    block_nodes_t(const block_graph_t& block_graph, const uint64_t& id_offset);
+
+    /// Add the nodes, then the edges, to a graph whose node count is the id offset.
+    void add_to(odgi::graph_t& graph) const;
+
+private:
+    // the sequence of node i (from 0) is [_seq_offsets[i], _seq_offsets[i+1])
+    std::string _seqs;
+    std::vector<uint64_t> _seq_offsets;
+    std::vector<uint64_t> _edges;
+};
+
+// default memory budget for keeping the compressed block graphs in memory
+const uint64_t DEFAULT_BLOCK_GRAPH_MEMORY_MAX = 4000000000;
+
+/**
+ * The compressed block graphs of a blockset, indexed by block id. Records stay
+ * in memory while they fit in the memory budget; beyond it they are appended
+ * to a temporary file, which is memory-mapped to read them back. Storing a
+ * block again replaces its record. Different blocks can be stored and read
+ * concurrently.
+ */
+class block_graph_store_t {
+public:
+    block_graph_store_t(const uint64_t& block_count, const uint64_t& max_memory);
+    ~block_graph_store_t();
+
+    block_graph_store_t(const block_graph_store_t&) = delete;
+    block_graph_store_t& operator=(const block_graph_store_t&) = delete;
+
+    [[nodiscard]] uint64_t size(void) const;
+
+    /// Make room for block ids up to block_count, while other threads store and read records.
+    void resize(const uint64_t& block_count);
+
+    /// True once some record had to go to disk.
+    [[nodiscard]] bool spilled(void) const { return _spilled.load(); }
+
+    void put(const uint64_t& block_id, std::string&& record);
+
+    /// Copy the record of a block into record.
+    void get(const uint64_t& block_id, std::string& record) const;
+
+    /// Drop a record we won't read again, freeing its memory.
+    void release(const uint64_t& block_id);
+
+private:
+
+    void _release(const uint64_t& block_id);
+
+    const char* _map_disk_record(const uint64_t& offset, const uint64_t& length,
+                                 std::shared_ptr<mio::mmap_source>& map) const;
+
+    uint64_t _max_memory;
+    std::atomic<uint64_t> _memory_used;
+    std::atomic<bool> _spilled;
+
+    // resize takes it exclusively, everything else shared
+    mutable std::shared_mutex _records_mutex;
+    std::vector<std::unique_ptr<std::string>> _records;
+    // offset and length in the file of the records on disk
+    std::vector<std::pair<uint64_t, uint64_t>> _disk_records;
+
+    mutable std::mutex _disk_mutex;
+    std::string _path_tmp_block_graphs;
+    std::ofstream _disk;
+    uint64_t _disk_size = 0;
+    // remapped when it no longer covers what has been written
+    mutable std::shared_ptr<mio::mmap_source> _map;
+};
+
+}
+
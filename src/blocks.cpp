@@ -1,12 +1,366 @@
+#include <limits>
 #include <deps/sdsl-lite/include/sdsl/int_vector.hpp>
 #include "blocks.hpp"
 #include "progress.hpp"
 
 namespace smoothxg {
 
+namespace {
+
+// the block the handle scan is growing
+struct open_block_t {
+    std::vector<handle_t> handles;
+    uint64_t total_path_length = 0;
+    ska::flat_hash_map<path_handle_t, std::pair<uint64_t, uint64_t>> path_coverage;
+    // a max-heap of the paths in the block by their length in the block
+    // every estimate is bounded by this length, which lets us stop scanning early
+    // a path gets a new entry whenever its length grows, the old ones are stale and dropped when popped
+    std::vector<std::pair<uint64_t, uint64_t>> paths_by_length;
+};
+
+// the steps that blocks have claimed, over the whole graph
+class claimed_steps_t {
+public:
+    explicit claimed_steps_t(const xg::XG& graph) : _seen_steps(graph.get_path_count()) {
+        uint64_t rank = 0;
+        graph.for_each_path_handle([&](const path_handle_t& path) {
+            sdsl::util::assign(_seen_steps[rank++], sdsl::bit_vector(graph.get_step_count(path), 0));
+        });
+    }
+
+    bool seen(const step_handle_t& step) const {
+        // in xg, the first half of the step is the path handle, which is it's rank + 1
+        // and the second half of the step is the rank in the path
+        return _seen_steps[path_rank(step)-1][step_rank(step)];
+    }
+
+    void mark(const step_handle_t& step) {
+        _seen_steps[path_rank(step)-1][step_rank(step)] = 1;
+    }
+
+    void next_block(void) {}
+
+private:
+    std::vector<sdsl::bit_vector> _seen_steps;
+};
+
+struct step_hash_t {
+    size_t operator()(const step_handle_t& step) const {
+        return std::hash<uint64_t>()(path_rank(step) * 0x9E3779B97F4A7C15ULL ^ step_rank(step));
+    }
+};
+
+// the steps a speculative scan of a chunk of handles has looked at and claimed, as if
+// nothing outside the chunk had claimed any; its blocks are numbered from the chunk start
+class chunk_steps_t {
+public:
+    static const uint64_t unclaimed = std::numeric_limits<uint64_t>::max();
+
+    bool seen(const step_handle_t& step) {
+        auto& entry = _steps[step];
+        entry.last_seen_by = _block;
+        return entry.claimed_by != unclaimed;
+    }
+
+    void mark(const step_handle_t& step) {
+        _steps[step].claimed_by = _block;
+    }
+
+    void next_block(void) {
+        ++_block;
+    }
+
+    uint64_t size(void) const {
+        return _steps.size();
+    }
+
+    // would the scan from first_block on have seen the same steps as claimed against the real
+    // claims, given that its blocks from first_block on are taken as they are? if not, conflict_block
+    // is the last block that looked at a step where they differ
+    bool agrees_with(const claimed_steps_t& claimed, const uint64_t& first_block, uint64_t& conflict_block) const {
+        for (auto& step : _steps) {
+            const entry_t& entry = step.second;
+            if (entry.last_seen_by >= first_block
+                && claimed.seen(step.first) != (entry.claimed_by < first_block)) {
+                conflict_block = entry.last_seen_by;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // mark what the blocks from first_block on claimed
+    void claim(claimed_steps_t& claimed, const uint64_t& first_block) const {
+        for (auto& step : _steps) {
+            if (step.second.claimed_by != unclaimed && step.second.claimed_by >= first_block) {
+                claimed.mark(step.first);
+            }
+        }
+    }
+
+private:
+    struct entry_t {
+        uint64_t claimed_by = unclaimed;
+        uint64_t last_seen_by = 0;
+    };
+    ska::flat_hash_map<step_handle_t, entry_t, step_hash_t> _steps;
+    uint64_t _block = 0;
+};
+
+// grows blocks over handles given in the graph's sort order, claiming path steps for them
+template<typename steps_t>
+class block_scanner_t {
+public:
+    block_scanner_t(const xg::XG& graph,
+                    steps_t& steps,
+                    const sdsl::bit_vector& long_edge_jump,
+                    const uint64_t& max_block_weight,
+                    const uint64_t& max_block_path_length,
+                    const uint64_t& max_path_jump,
+                    const uint64_t& max_edge_jump,
+                    const std::function<void(block_t&)>& emit_block)
+        : _graph(graph), _steps(steps), _long_edge_jump(long_edge_jump),
+          _max_block_weight(max_block_weight), _max_block_path_length(max_block_path_length),
+          _max_path_jump(max_path_jump), _max_edge_jump(max_edge_jump), _emit_block(emit_block) {}
+
+    // add a handle to the open block, finalizing the block first if the handle doesn't fit;
+    // returns true if the handle starts a new block, with the unclaimed sequence it brings
+    bool add_handle(const handle_t& handle, uint64_t& sequence_to_add);
+
+    // claim the steps of the open block and emit them as a block, if there are any
+    void finalize_block(void);
+
+    open_block_t open;
+
+private:
+    const xg::XG& _graph;
+    steps_t& _steps;
+    const sdsl::bit_vector& _long_edge_jump;
+    const uint64_t _max_block_weight;
+    const uint64_t _max_block_path_length;
+    const uint64_t _max_path_jump;
+    const uint64_t _max_edge_jump;
+    const std::function<void(block_t&)> _emit_block;
+    // the heap entries popped while estimating path lengths, to push back
+    std::vector<std::pair<uint64_t, uint64_t>> _popped_paths;
+};
+
+template<typename steps_t>
+bool block_scanner_t<steps_t>::add_handle(const handle_t& handle, uint64_t& sequence_to_add) {
+    const xg::XG& graph = _graph;
+    // how much sequence would we be adding to the block?
+    int64_t handle_length = graph.get_length(handle);
+
+    sequence_to_add = 0;
+    graph.for_each_step_on_handle(
+        handle,
+        [&](const step_handle_t& step) {
+            if (!_steps.seen(step)) {
+                sequence_to_add += handle_length;
+            }
+        });
+
+    // nb. this doesn't count duplicate traversals, but doing so would require running a full block traversal at every handle
+    uint64_t max_path_length = 0;
+    auto& paths_by_length = open.paths_by_length;
+    while (!paths_by_length.empty()) {
+        auto p = paths_by_length.front();
+        if (p.first + handle_length <= max_path_length) {
+            break; // no remaining path can give a longer estimate
+        }
+        std::pop_heap(paths_by_length.begin(), paths_by_length.end());
+        paths_by_length.pop_back();
+        auto& coverage = open.path_coverage[as_path_handle(p.second)];
+        if (coverage.first != p.first) {
+            continue; // stale, the path's current entry came out earlier
+        }
+        _popped_paths.push_back(p);
+        uint64_t path_len_est = std::round((double)coverage.first
+                                           / (coverage.second < open.handles.size()
+                                              ? 1.0
+                                              : (double) coverage.second / (double) open.handles.size()));
+        max_path_length = std::max(path_len_est + handle_length, max_path_length);
+    }
+    for (auto& p : _popped_paths) {
+        paths_by_length.push_back(p);
+        std::push_heap(paths_by_length.begin(), paths_by_length.end());
+    }
+    _popped_paths.clear();
+
+    bool new_block = open.handles.empty();
+    if (
+            // if it is not the first handle in the block
+            !open.handles.empty() &&
+
+            // if we add to the current block, do we go over our total path length?
+            // do we have a path that seems to exceed our length limit?
+            ((open.total_path_length + sequence_to_add > _max_block_weight)
+             || (_max_edge_jump && _long_edge_jump[graph.id_to_rank(graph.get_id(handle)) - 1])
+             || max_path_length > _max_block_path_length)
+    ) {
+        // finalize the previous block and start a new one
+        finalize_block();
+        new_block = true;
+    }
+
+    open.total_path_length += sequence_to_add;
+
+    graph.for_each_step_on_handle(
+        handle,
+        [&](const step_handle_t& step) {
+            if (!_steps.seen(step)) {
+                path_handle_t path = graph.get_path_handle_of_step(step);
+                auto& coverage = open.path_coverage[path];
+                if (!coverage.second || handle_length) {
+                    paths_by_length.emplace_back(coverage.first + handle_length, as_integer(path));
+                    std::push_heap(paths_by_length.begin(), paths_by_length.end());
+                }
+                coverage.first += handle_length;
+                coverage.second++;
+            }
+        });
+
+    // rebuild the heap from the current lengths once it is mostly stale entries
+    if (paths_by_length.size() > 2 * open.path_coverage.size() + 64) {
+        paths_by_length.clear();
+        for (auto& coverage : open.path_coverage) {
+            paths_by_length.emplace_back(coverage.second.first, as_integer(coverage.first));
+        }
+        std::make_heap(paths_by_length.begin(), paths_by_length.end());
+    }
+
+    open.handles.push_back(handle);
+
+    return new_block;
+}
+
+template<typename steps_t>
+void block_scanner_t<steps_t>::finalize_block(void) {
+    const xg::XG& graph = _graph;
+    block_t block;
+
+    // collect the steps on all handles
+    std::vector<step_handle_t> traversals;
+    for (auto& handle : open.handles) {
+        graph.for_each_step_on_handle(
+            handle,
+            [&](const step_handle_t& step) {
+                if (!_steps.seen(step)) {
+                    traversals.push_back(step);
+                }
+            });
+    }
+
+    // sort them
+    std::sort(
+        traversals.begin(), traversals.end(),
+        [&](const step_handle_t& a, const step_handle_t& b) {
+            return path_rank(a) < path_rank(b) || path_rank(a) == path_rank(b) && step_rank(a) < step_rank(b);
+        });
+
+    // determine the path ranges in the block
+    // break them when we pass some threshold for how much block-external sequence to include
+    // (this parameter is meant to allow us to reduce dispersed collapses in the graph)
+    // break them when they jump more than max_path_jump in our graph sort order
+    // TODO explore breaking when we have a significant change in coverage relative to the average in the region
+    std::vector<path_range_t> path_ranges;
+    for (auto& step : traversals) {
+        if (path_ranges.empty()) {
+            path_ranges.push_back({step, step, 0});
+        } else {
+            auto& path_range = path_ranges.back();
+            auto& last = path_range.end;
+            if (path_rank(last) != path_rank(step)
+                || (graph.get_position_of_step(step)
+                    - (graph.get_position_of_step(last) + graph.get_length(graph.get_handle_of_step(last)))
+                    > _max_path_jump)) {
+                // make a new range
+                path_ranges.push_back({step, step, 0});
+            } else {
+                // extend the range
+                last = step;
+            }
+        }
+    }
+
+    // break the path ranges on seen steps
+    for (auto& path_range : path_ranges) {
+        // update the path range end to point to the one-past element
+        path_range.end = graph.get_next_step(path_range.end);
+        path_range_t* curr_path_range = nullptr;
+        step_handle_t curr_step;
+        for (curr_step = path_range.begin;
+             curr_step != path_range.end;
+             curr_step = graph.get_next_step(curr_step)) {
+            //if (curr_step == graph.path_end(graph.get_path_handle_of_step(curr_step))
+            if (curr_path_range == nullptr) {
+                block.path_ranges.emplace_back();
+                curr_path_range = &block.path_ranges.back();
+                curr_path_range->begin = curr_step;
+            }
+            curr_path_range->end = curr_step;
+            if (_steps.seen(curr_step)) {
+                curr_path_range = nullptr;
+            }
+        }
+        if (curr_path_range != nullptr) {
+            curr_path_range->end = curr_step;
+        }
+    }
+
+    // erase any empty path ranges that we picked up
+    block.path_ranges.erase(
+        std::remove_if(
+            block.path_ranges.begin(), block.path_ranges.end(),
+            [&graph](const path_range_t& path_range) {
+                return path_range.begin == path_range.end;
+            }),
+        block.path_ranges.end());
+
+    // finally, mark which steps we've kept and record the total length
+    uint64_t _total_path_length = 0; // recalculate how much sequence we have in the block
+    for (auto& path_range : block.path_ranges) {
+        auto& included_path_length = path_range.length;
+        included_path_length = 0;
+        // here we need to break when we see significant nonlinearities
+        for (step_handle_t curr_step = path_range.begin;
+             curr_step != path_range.end;
+             curr_step = graph.get_next_step(curr_step)) {
+            _steps.mark(curr_step);
+            included_path_length += graph.get_length(graph.get_handle_of_step(curr_step));
+        }
+        _total_path_length += included_path_length;
+    }
+
+    if (_total_path_length > 0) {
+        _emit_block(block);
+    }
+
+    _steps.next_block();
+    std::vector<handle_t>().swap(open.handles);
+    open.total_path_length = 0;
+    open.path_coverage.clear();
+    open.paths_by_length.clear();
+}
+
+// what a speculative scan of a chunk of the handle order found
+struct chunk_scan_t {
+    uint64_t begin = 0;
+    uint64_t end = 0;         // one past the last handle rank the scan got to
+    uint64_t chunk_end = 0;   // one past the last handle rank of the chunk
+    // the rank of the first handle of each block, and the unclaimed sequence it brought
+    std::vector<std::pair<uint64_t, uint64_t>> block_starts;
+    // the non-empty blocks, by block number
+    std::vector<std::pair<uint64_t, block_t>> blocks;
+    chunk_steps_t steps;
+    open_block_t open;
+};
+
+}
+
 void smoothable_blocks(
     const xg::XG& graph,
-    blockset_t& blockset,
+    const std::function<void(block_t&)>& emit_block,
     const uint64_t& max_block_weight,
     const uint64_t& max_block_path_length,
     const uint64_t& max_path_jump,
@@ -16,30 +370,10 @@ void smoothable_blocks(
 	const std::string& smoothxg_iter
     ) {
     // iterate over the handles in their vectorized order, collecting blocks that we can potentially smooth
-    block_t block;
-    std::vector<handle_t> block_handles;
-    std::vector<sdsl::bit_vector> seen_steps(graph.get_path_count());
 
     // cast to vectorizable graph for determining the sort position of nodes
     const VectorizableHandleGraph& vec_graph = dynamic_cast<const VectorizableHandleGraph&>(graph);
 
-    uint64_t rank = 0;
-    graph.for_each_path_handle([&](const path_handle_t& path) {
-        sdsl::util::assign(seen_steps[rank++], sdsl::bit_vector(graph.get_step_count(path), 0));
-    });
-
-    rank = 0;
-
-    auto seen_step =
-        [&](const step_handle_t& step) {
-            // in xg, the first half of the step is the path handle, which is it's rank + 1
-            // and the second half of the step is the rank in the path
-            return seen_steps[path_rank(step)-1][step_rank(step)];
-        };
-    auto mark_step =
-        [&](const step_handle_t& step) {
-            seen_steps[path_rank(step)-1][step_rank(step)] = 1;
-        };
     auto toposplit_block =
         [&](const block_t& block) {
             ska::flat_hash_map<uint64_t, uint64_t> id_to_entry;
@@ -103,108 +437,18 @@ void smoothable_blocks(
             }
             return blocks;
         };
-    auto finalize_block =
-        [&](block_t& block, std::vector<handle_t>& block_handles) {
-            // collect the steps on all handles
-            std::vector<step_handle_t> traversals;
-            for (auto& handle : block_handles) {
-                graph.for_each_step_on_handle(
-                    handle,
-                    [&](const step_handle_t& step) {
-                        if (!seen_step(step)) {
-                            traversals.push_back(step);
-                        }
-                    });
-            }
-
-            std::vector<handle_t>().swap(block_handles);
-
-            // sort them
-            std::sort(
-                traversals.begin(), traversals.end(),
-                [&](const step_handle_t& a, const step_handle_t& b) {
-                    return path_rank(a) < path_rank(b) || path_rank(a) == path_rank(b) && step_rank(a) < step_rank(b);
-                });
-
-            // determine the path ranges in the block
-            // break them when we pass some threshold for how much block-external sequence to include
-            // (this parameter is meant to allow us to reduce dispersed collapses in the graph)
-            // break them when they jump more than max_path_jump in our graph sort order
-            // TODO explore breaking when we have a significant change in coverage relative to the average in the region
-            std::vector<path_range_t> path_ranges;
-            for (auto& step : traversals) {
-                if (path_ranges.empty()) {
-                    path_ranges.push_back({step, step, 0});
-                } else {
-                    auto& path_range = path_ranges.back();
-                    auto& last = path_range.end;
-                    if (path_rank(last) != path_rank(step)
-                        || (graph.get_position_of_step(step)
-                            - (graph.get_position_of_step(last) + graph.get_length(graph.get_handle_of_step(last)))
-                            > max_path_jump)) {
-                        // make a new range
-                        path_ranges.push_back({step, step, 0});
-                    } else {
-                        // extend the range
-                        last = step;
-                    }
-                }
-            }
-
-            // break the path ranges on seen steps
-            for (auto& path_range : path_ranges) {
-                // update the path range end to point to the one-past element
-                path_range.end = graph.get_next_step(path_range.end);
-                path_range_t* curr_path_range = nullptr;
-                step_handle_t curr_step;
-                for (curr_step = path_range.begin;
-                     curr_step != path_range.end;
-                     curr_step = graph.get_next_step(curr_step)) { 
-                    //if (curr_step == graph.path_end(graph.get_path_handle_of_step(curr_step))
-                    if (curr_path_range == nullptr) {
-                        block.path_ranges.emplace_back();
-                        curr_path_range = &block.path_ranges.back();
-                        curr_path_range->begin = curr_step;
-                    }
-                    curr_path_range->end = curr_step;
-                    if (seen_step(curr_step)) {
-                        curr_path_range = nullptr;
-                    }
-                }
-                if (curr_path_range != nullptr) {
-                    curr_path_range->end = curr_step;
-                }
-            }
-
-            // erase any empty path ranges that we picked up
-            block.path_ranges.erase(
-                std::remove_if(
-                    block.path_ranges.begin(), block.path_ranges.end(),
-                    [&graph](const path_range_t& path_range) {
-                        return path_range.begin == path_range.end;
-                    }),
-                block.path_ranges.end());
-
-            // finally, mark which steps we've kept and record the total length
-            uint64_t _total_path_length = 0; // recalculate how much sequence we have in the block
-            for (auto& path_range : block.path_ranges) {
-                auto& included_path_length = path_range.length;
-                included_path_length = 0;
-                // here we need to break when we see significant nonlinearities
-                for (step_handle_t curr_step = path_range.begin;
-                     curr_step != path_range.end;
-                     curr_step = graph.get_next_step(curr_step)) {
-                    mark_step(curr_step);
-                    included_path_length += graph.get_length(graph.get_handle_of_step(curr_step));
-                }
-                _total_path_length += included_path_length;
-            }
-
-            if (_total_path_length > 0) {
+    // blocks whose steps have been claimed, waiting to be sorted and split
+    std::vector<block_t> pending_blocks;
+    const uint64_t max_pending_blocks = 256 * std::max(num_threads, 1);
+    auto flush_pending_blocks =
+        [&](void) {
+            std::vector<std::vector<block_t>> splits(pending_blocks.size());
+#pragma omp parallel for schedule(dynamic,1) num_threads(num_threads)
+            for (uint64_t i = 0; i < pending_blocks.size(); ++i) {
+                auto& pending = pending_blocks[i];
                 // order the path ranges from longest/shortest to shortest/longest
-                // this gets called lots of times... probably best to make it std::sort or not parallel
                 std::sort(
-                        block.path_ranges.begin(), block.path_ranges.end(),
+                        pending.path_ranges.begin(), pending.path_ranges.end(),
                         order_paths_from_longest
                         ?
                         [](const path_range_t& a,
@@ -221,109 +465,184 @@ void smoothable_blocks(
                 // split blocks by graph topology
                 // here weakly connected components of the graph are split apart
                 // so that we do not compress disparate parts of the graph in one POA block
-                for (auto& split : toposplit_block(block)) {
-                    blockset.add_block(rank++, split);
+                splits[i] = toposplit_block(pending);
+                std::vector<path_range_t>().swap(pending.path_ranges);
+            }
+            // emit them in order, so the block ids are the same as if we'd done this serially
+            for (auto& split_blocks : splits) {
+                for (auto& split : split_blocks) {
+                    emit_block(split);
                 }
-            };
-
-            std::vector<path_range_t>().swap(block.path_ranges);
+            }
+            pending_blocks.clear();
         };
-
     std::stringstream blocks_banner;
     blocks_banner << smoothxg_iter << "::smoothable_blocks] computing blocks for "
                     << graph.get_node_count() << " handles:";
     progress_meter::ProgressMeter blocks_progress(graph.get_node_count(), blocks_banner.str());
 
-    uint64_t total_path_length = 0;
-    ska::flat_hash_map<path_handle_t, std::pair<uint64_t, uint64_t>> path_coverage;
-
-    graph.for_each_handle(
-        [&](const handle_t& handle) {
-            // how much sequence would we be adding to the block?
-            int64_t handle_length = graph.get_length(handle);
-
-            uint64_t sequence_to_add = 0;
-            graph.for_each_step_on_handle(
-                handle,
-                [&](const step_handle_t& step) {
-                    if (!seen_step(step)) {
-                        sequence_to_add += handle_length;
-                    }
-                });
-
-            // nb. this doesn't count duplicate traversals, but doing so would require running a full block traversal at every handle
-            uint64_t max_path_length = 0;
-            for (auto& p : path_coverage) {
-                uint64_t path_len_est = std::round((double)p.second.first
-                                                   / (p.second.second < block_handles.size()
-                                                      ? 1.0
-                                                      : (double) p.second.second / (double) block_handles.size()));
-                max_path_length = std::max(path_len_est + handle_length, max_path_length);
+    // the edge jump test depends only on the graph, so we run it for all handles up front in parallel
+    sdsl::bit_vector long_edge_jump;
+    if (max_edge_jump) {
+        const uint64_t node_count = graph.get_node_count();
+        sdsl::util::assign(long_edge_jump, sdsl::bit_vector(node_count, 0));
+        // handle whole 64-bit words per iteration so that threads never write to the same word
+#pragma omp parallel for schedule(dynamic,1) num_threads(num_threads)
+        for (uint64_t word = 0; word < (node_count + 63) / 64; ++word) {
+            for (uint64_t i = word * 64; i < std::min(node_count, (word + 1) * 64); ++i) {
+                handle_t handle = graph.get_handle(graph.rank_to_id(i + 1));
+                int64_t handle_length = graph.get_length(handle);
+                // for each edge, find the jump length
+                int64_t longest_edge_jump = 0;
+                int64_t handle_vec_offset = vec_graph.node_vector_offset(graph.get_id(handle));
+                graph.follow_edges(
+                    handle, false,
+                    [&](const handle_t& o) {
+                        int64_t other_vec_offset = vec_graph.node_vector_offset(graph.get_id(o))
+                            + (graph.get_is_reverse(o) ? graph.get_length(o) : 0);
+                        int64_t jump = std::abs(other_vec_offset - (handle_vec_offset + handle_length));
+                        longest_edge_jump = std::max(longest_edge_jump, jump);
+                    });
+                graph.follow_edges(
+                    handle, true,
+                    [&](const handle_t& o) {
+                        int64_t other_vec_offset = vec_graph.node_vector_offset(graph.get_id(o))
+                            + (graph.get_is_reverse(o) ? 0 : graph.get_length(o));
+                        int64_t jump = std::abs(other_vec_offset - handle_vec_offset);
+                        longest_edge_jump = std::max(longest_edge_jump, jump);
+                    });
+                long_edge_jump[i] = longest_edge_jump > max_edge_jump;
             }
+        }
+    }
 
-            // for each edge, find the jump length
-            int64_t longest_edge_jump = 0;
-            int64_t handle_vec_offset = vec_graph.node_vector_offset(graph.get_id(handle));
-            graph.follow_edges(
-                handle, false,
-                [&](const handle_t& o) {
-                    int64_t other_vec_offset = vec_graph.node_vector_offset(graph.get_id(o))
-                        + (graph.get_is_reverse(o) ? graph.get_length(o) : 0);
-                    int64_t jump = std::abs(other_vec_offset - (handle_vec_offset + handle_length));
-                    longest_edge_jump = std::max(longest_edge_jump, jump);
-                });
-            graph.follow_edges(
-                handle, true,
-                [&](const handle_t& o) {
-                    int64_t other_vec_offset = vec_graph.node_vector_offset(graph.get_id(o))
-                        + (graph.get_is_reverse(o) ? 0 : graph.get_length(o));
-                    int64_t jump = std::abs(other_vec_offset - handle_vec_offset);
-                    longest_edge_jump = std::max(longest_edge_jump, jump);
-                });
-
-            if (
-                    // if it is not the first handle in the block
-                    !block_handles.empty() &&
-
-                    // if we add to the current block, do we go over our total path length?
-                    // do we have a path that seems to exceed our length limit?
-                    ((total_path_length + sequence_to_add > max_block_weight)
-                     || (max_edge_jump && longest_edge_jump > max_edge_jump)
-                     || max_path_length > max_block_path_length)
-            ) {
-                // finalize the previous block and start a new one
-                finalize_block(block, block_handles);
-
-                total_path_length = 0;
-                path_coverage.clear();
+    auto add_pending_block =
+        [&](block_t& block) {
+            // the rest only depends on the block itself, so we do it later in parallel
+            pending_blocks.emplace_back();
+            pending_blocks.back().path_ranges.swap(block.path_ranges);
+            if (pending_blocks.size() >= max_pending_blocks) {
+                flush_pending_blocks();
             }
+        };
 
-            total_path_length += sequence_to_add;
-
-            graph.for_each_step_on_handle(
-                handle,
-                [&](const step_handle_t& step) {
-                    if (!seen_step(step)) {
-                        path_coverage[graph.get_path_handle_of_step(step)].first += handle_length;
-                        path_coverage[graph.get_path_handle_of_step(step)].second++;
-                    }
-                });
+    const uint64_t node_count = graph.get_node_count();
+    auto handle_at_rank =
+        [&](const uint64_t& rank) {
+            return graph.get_handle(graph.rank_to_id(rank + 1));
+        };
 
-            block_handles.push_back(handle);
+    claimed_steps_t claimed(graph);
+    block_scanner_t<claimed_steps_t> scanner(graph, claimed, long_edge_jump,
+                                             max_block_weight, max_block_path_length,
+                                             max_path_jump, max_edge_jump,
+                                             add_pending_block);
+
+    // Which steps a block claims depends on every block before it, so the scan is serial at heart.
+    // To spread it over threads, each chunk of the handle order is first scanned speculatively,
+    // as if a block started at the chunk and nothing outside the chunk had claimed any steps.
+    // The serial scan then walks the chunks in order. Once it starts a block on the same handle
+    // and with the same unclaimed sequence as the chunk did, and every step the chunk looked at
+    // from there on was claimed exactly when the chunk assumed, it takes the chunk's blocks and
+    // open block as they are. Until then, or if that never happens, it scans the handles itself,
+    // so the blocks are the same as a serial scan's whatever the chunking.
+    // The serial scan needs a few blocks to fall in step with a chunk, so chunks are as long as
+    // the threads allow, up to about max_chunk_steps steps each to bound what a chunk tracks.
+    // A chunk scan that runs past that anyway stops early and leaves the rest to the serial scan.
+    const uint64_t max_chunk_steps = 1 << 22;
+    uint64_t step_count = 0;
+    graph.for_each_path_handle([&](const path_handle_t& path) {
+        step_count += graph.get_step_count(path);
+    });
+    const uint64_t chunk_size = num_threads > 1
+            ? std::max((uint64_t)1024,
+                       std::min((node_count + num_threads - 1) / num_threads,
+                                (uint64_t)((double)node_count * max_chunk_steps / std::max(step_count, (uint64_t)1))))
+            : node_count;
+    const uint64_t chunks_per_wave = num_threads > 1 ? num_threads : 0;
 
-            blocks_progress.increment(1);
-        });
+    uint64_t rank = 0;
+    while (rank < node_count) {
+        std::vector<chunk_scan_t> chunks;
+        for (uint64_t begin = rank;
+             begin < node_count && chunks.size() < std::max(chunks_per_wave, (uint64_t)1);
+             begin += chunk_size) {
+            chunks.emplace_back();
+            chunks.back().begin = chunks.back().end = begin;
+            chunks.back().chunk_end = std::min(node_count, begin + chunk_size);
+        }
+        if (chunks_per_wave > 0) {
+#pragma omp parallel for schedule(dynamic,1) num_threads(num_threads)
+            for (uint64_t i = 0; i < chunks.size(); ++i) {
+                auto& chunk = chunks[i];
+                // a block is finalized just before the next one starts
+                std::function<void(block_t&)> keep_block =
+                    [&](block_t& block) {
+                        chunk.blocks.emplace_back(chunk.block_starts.size() - 1, block_t());
+                        chunk.blocks.back().second.path_ranges.swap(block.path_ranges);
+                    };
+                block_scanner_t<chunk_steps_t> chunk_scanner(graph, chunk.steps, long_edge_jump,
+                                                             max_block_weight, max_block_path_length,
+                                                             max_path_jump, max_edge_jump,
+                                                             keep_block);
+                for (; chunk.end < chunk.chunk_end && chunk.steps.size() < max_chunk_steps; ++chunk.end) {
+                    uint64_t sequence_to_add;
+                    if (chunk_scanner.add_handle(handle_at_rank(chunk.end), sequence_to_add)) {
+                        chunk.block_starts.emplace_back(chunk.end, sequence_to_add);
+                    }
+                }
+                chunk.open = std::move(chunk_scanner.open);
+            }
+        }
+
+        for (auto& chunk : chunks) {
+            uint64_t next_block = 0;
+            uint64_t first_usable_block = 0;
+            while (rank < chunk.chunk_end) {
+                uint64_t sequence_to_add;
+                const bool new_block = scanner.add_handle(handle_at_rank(rank), sequence_to_add);
+                blocks_progress.increment(1);
+                ++rank;
+                if (!new_block || rank > chunk.end) {
+                    continue;
+                }
+                // did the chunk start a block here too?
+                while (next_block < chunk.block_starts.size() && chunk.block_starts[next_block].first < rank - 1) {
+                    ++next_block;
+                }
+                if (next_block == chunk.block_starts.size()
+                    || chunk.block_starts[next_block].first != rank - 1
+                    || chunk.block_starts[next_block].second != sequence_to_add
+                    || next_block < first_usable_block) {
+                    continue;
+                }
+                uint64_t conflict_block;
+                if (!chunk.steps.agrees_with(claimed, next_block, conflict_block)) {
+                    first_usable_block = conflict_block + 1;
+                    continue;
+                }
+                // take over the chunk's scan from this block on
+                chunk.steps.claim(claimed, next_block);
+                for (auto& block : chunk.blocks) {
+                    if (block.first >= next_block) {
+                        add_pending_block(block.second);
+                    }
+                }
+                scanner.open = std::move(chunk.open);
+                blocks_progress.increment(chunk.end - rank);
+                rank = chunk.end;
+                next_block = chunk.block_starts.size();
+            }
+        }
+    }
 
     blocks_progress.finish();
-    
-    if (block.path_ranges.empty()) {
-        finalize_block(block, block_handles);
-    }
+
+    scanner.finalize_block();
+    flush_pending_blocks();
 
     // at the end, we'll be left with some fragments of paths that aren't included in any blocks
     // that's ok, but we should see how much of a problem it is / should they be compressed?
-
-    blockset.index(num_threads);
 }
 
 }
@@ -5,7 +5,11 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
-#include <vector>
+#include <set>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include "mmmultimap.hpp"
 #include "xg.hpp"
 #include "flat_hash_map.hpp"
@@ -67,21 +71,91 @@ struct ranked_path_range_t {
     }
 };
 
+// a read-only view of the path ranges of a block, valid while what it points into is
+class path_ranges_view_t {
+private:
+    const path_range_t* _begin = nullptr;
+    const path_range_t* _end = nullptr;
+
+public:
+    path_ranges_view_t(const path_range_t* begin, const path_range_t* end) : _begin(begin), _end(end) {}
+
+    [[nodiscard]] const path_range_t* begin() const {
+        return _begin;
+    }
+
+    [[nodiscard]] const path_range_t* end() const {
+        return _end;
+    }
+
+    [[nodiscard]] uint64_t size() const {
+        return _end - _begin;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return _begin == _end;
+    }
+
+    const path_range_t& operator[](const uint64_t i) const {
+        return _begin[i];
+    }
+};
+
+// default memory budget for keeping a blockset's path ranges in memory
+const uint64_t DEFAULT_BLOCKSET_MEMORY_MAX = 4000000000;
+
 class blockset_t {
 private:
     uint64_t _num_blocks = 0;
+    uint64_t _max_memory = DEFAULT_BLOCKSET_MEMORY_MAX;
+
+    // while the blocks fit in our memory budget they're laid out contiguously in block id order,
+    // with the path ranges of block i in [_offsets[i], _offsets[i+1])
+    std::vector<path_range_t> _path_ranges;
+    std::vector<uint64_t> _offsets = {0};
+
+    // beyond that, or if blocks arrive out of order, they go to disk
     mmmulti::map<uint64_t, ranked_path_range_t>* _blocks = nullptr;
 
     std::string _path_tmp_blocks;
 
-public:
-    explicit blockset_t() {
-        _path_tmp_blocks = temp_file::create();
+    void _append_to_disk(const uint64_t block_id, const path_range_t* begin, const path_range_t* end) {
+        for (uint64_t rank = 0; begin + rank != end; ++rank) {
+            _blocks->append(
+                block_id + 1,
+                {rank, *(begin + rank)}
+            );
+        }
+    }
 
-        _num_blocks = 0;
-        _blocks = new mmmulti::map<uint64_t, ranked_path_range_t>(_path_tmp_blocks, {0});
+    // the capacity v needs to hold size elements: its current one if that is enough, otherwise
+    // a quarter more, rather than the doubling that insert and push_back would pick
+    template<typename T>
+    static uint64_t _capacity_for(const std::vector<T>& v, const uint64_t size) {
+        if (size <= v.capacity()) {
+            return v.capacity();
+        }
+        return std::max(size, (uint64_t)(v.capacity() + v.capacity() / 4 + 1024));
+    }
 
+    void _move_to_disk() {
+        _path_tmp_blocks = temp_file::create();
+        _blocks = new mmmulti::map<uint64_t, ranked_path_range_t>(_path_tmp_blocks, {0});
         _blocks->open_writer();
+
+        for (uint64_t block_id = 0; block_id + 1 < _offsets.size(); ++block_id) {
+            _append_to_disk(block_id,
+                            _path_ranges.data() + _offsets[block_id],
+                            _path_ranges.data() + _offsets[block_id + 1]);
+        }
+        std::vector<path_range_t>().swap(_path_ranges);
+        std::vector<uint64_t>().swap(_offsets);
+    }
+
+public:
+    explicit blockset_t(const uint64_t max_memory = DEFAULT_BLOCKSET_MEMORY_MAX) {
+        _num_blocks = 0;
+        _max_memory = max_memory;
     }
 
     ~blockset_t(){
@@ -95,35 +169,151 @@ public:
         return _num_blocks;
     }
 
+    [[nodiscard]] uint64_t max_memory() const {
+        return _max_memory;
+    }
+
+    [[nodiscard]] bool in_memory() const {
+        return _blocks == nullptr;
+    }
+
     void add_block(const uint64_t block_id, block_t& block) {
         _num_blocks += 1;
 
-        for (uint64_t rank = 0; rank < block.path_ranges.size(); ++rank) {
-            _blocks->append(
-                block_id + 1,
-                {rank, block.path_ranges[rank]}
-            );
+        if (in_memory()) {
+            // count what the vectors allocate, not just what they hold
+            const uint64_t path_ranges_capacity = _capacity_for(_path_ranges, _path_ranges.size() + block.path_ranges.size());
+            const uint64_t offsets_capacity = _capacity_for(_offsets, _offsets.size() + 1);
+            uint64_t memory_needed = path_ranges_capacity * sizeof(path_range_t) + offsets_capacity * sizeof(uint64_t);
+            // while a vector is reallocated, its old buffer is still there
+            if (path_ranges_capacity != _path_ranges.capacity()) {
+                memory_needed += _path_ranges.capacity() * sizeof(path_range_t);
+            }
+            if (offsets_capacity != _offsets.capacity()) {
+                memory_needed += _offsets.capacity() * sizeof(uint64_t);
+            }
+            if (block_id + 1 == _offsets.size() && memory_needed <= _max_memory) {
+                _path_ranges.reserve(path_ranges_capacity);
+                _offsets.reserve(offsets_capacity);
+                _path_ranges.insert(_path_ranges.end(), block.path_ranges.begin(), block.path_ranges.end());
+                _offsets.push_back(_path_ranges.size());
+                return;
+            }
+            _move_to_disk();
         }
+
+        _append_to_disk(block_id,
+                        block.path_ranges.data(),
+                        block.path_ranges.data() + block.path_ranges.size());
     }
 
     void index(const uint64_t num_threads) {
-        _blocks->index(num_threads, _num_blocks);
+        if (in_memory()) {
+            _path_ranges.shrink_to_fit();
+            _offsets.shrink_to_fit();
+        } else {
+            _blocks->index(num_threads, _num_blocks);
+        }
+    }
+
+    // the path ranges of block_id, in place while the blocks are in memory,
+    // otherwise read from disk into buffer, which the view then points into
+    [[nodiscard]] path_ranges_view_t get_path_ranges(uint64_t block_id, std::vector<path_range_t>& buffer) const {
+        if (in_memory()) {
+            return {_path_ranges.data() + _offsets[block_id],
+                    _path_ranges.data() + _offsets[block_id + 1]};
+        }
+        buffer.clear();
+        for (auto& ranked_path_range : _blocks->values(block_id + 1)){
+            buffer.push_back(ranked_path_range.path_range);
+        }
+        return {buffer.data(), buffer.data() + buffer.size()};
+    }
+
+    // the total sequence length of the path ranges of block_id
+    [[nodiscard]] uint64_t block_length_sum(uint64_t block_id) const {
+        uint64_t length_sum = 0;
+        if (in_memory()) {
+            for (uint64_t i = _offsets[block_id]; i < _offsets[block_id + 1]; ++i) {
+                length_sum += _path_ranges[i].length;
+            }
+        } else {
+            for (auto& ranked_path_range : _blocks->values(block_id + 1)){
+                length_sum += ranked_path_range.path_range.length;
+            }
+        }
+        return length_sum;
     }
 
     [[nodiscard]] block_t get_block(uint64_t block_id) const {
         block_t block;
-        for (auto& ranked_path_range : _blocks->values(block_id + 1)){
-            block.path_ranges.push_back(ranked_path_range.path_range);
+        if (in_memory()) {
+            block.path_ranges.assign(_path_ranges.begin() + _offsets[block_id],
+                                     _path_ranges.begin() + _offsets[block_id + 1]);
+        } else {
+            for (auto& ranked_path_range : _blocks->values(block_id + 1)){
+                block.path_ranges.push_back(ranked_path_range.path_range);
+            }
         }
         return block;
     }
 };
 
+// a bounded queue handing blocks from one stage to the next, in the order they are pushed
+class block_queue_t {
+private:
+    std::mutex _mutex;
+    std::condition_variable _not_full;
+    std::condition_variable _not_empty;
+    std::deque<block_t> _blocks;
+    const uint64_t _max_size;
+    uint64_t _popped = 0;
+    bool _closed = false;
+
+public:
+    explicit block_queue_t(const uint64_t max_size) : _max_size(std::max(max_size, (uint64_t)1)) {}
+
+    // wait for room, then take the path ranges of block
+    void push(block_t& block) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_full.wait(lock, [&]() { return _blocks.size() < _max_size; });
+        _blocks.emplace_back();
+        _blocks.back().path_ranges.swap(block.path_ranges);
+        lock.unlock();
+        _not_empty.notify_one();
+    }
+
+    // no more blocks are coming
+    void close() {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _closed = true;
+        }
+        _not_empty.notify_all();
+    }
+
+    // wait for the next block and its rank in the queue order, false once the queue is closed and drained
+    bool pop(uint64_t& rank, block_t& block) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _not_empty.wait(lock, [&]() { return !_blocks.empty() || _closed; });
+        if (_blocks.empty()) {
+            return false;
+        }
+        block.path_ranges.swap(_blocks.front().path_ranges);
+        _blocks.pop_front();
+        rank = _popped++;
+        lock.unlock();
+        _not_full.notify_one();
+        return true;
+    }
+};
+
 // find the boundaries of blocks that we can compress with spoa
-// assuming a maximum path length within each block
+// assuming a maximum path length within each block,
+// handing each block to emit_block as soon as it's found, in block id order
     void smoothable_blocks(
     const xg::XG& graph,
-    blockset_t& blockset,
+    const std::function<void(block_t&)>& emit_block,
     const uint64_t& max_block_weight,
     const uint64_t& max_block_path_length,
     const uint64_t& max_path_jump,
@@ -1,6 +1,5 @@
 #include <deps/odgi/src/odgi.hpp>
 #include "breaks.hpp"
-#include "progress.hpp"
 #include "atomic_bitvector.hpp"
 #include "smooth.hpp"
 #include "rkmh.hpp"
@@ -20,10 +19,8 @@ namespace smoothxg {
         for (auto &path_range : block.path_ranges) {
             seqs.emplace_back();
             auto &seq = seqs.back();
-            for (step_handle_t step = path_range.begin; step != path_range.end;
-                 step = graph.get_next_step(step)) {
-                seq.append(graph.get_sequence(graph.get_handle_of_step(step)));
-            }
+            seq.reserve(path_range.length);
+            graph.append_path_range_sequence(path_range.begin, path_range.end, seq);
             std::stringstream namess;
             namess << graph.get_path_name(
                     graph.get_path_handle_of_step(path_range.begin))
@@ -101,45 +98,33 @@ namespace smoothxg {
         return (double)(matches) / (double)(matches + mismatches + indels);
     }
 
-// break the path ranges at likely VNTR boundaries
-// and break the path ranges to be shorter than our "max" sequence size input to spoa
-    void break_blocks(const xg::XG &graph,
-                      blockset_t *&blockset,
-                      const double &length_ratio_min,
-                      const uint64_t &min_length_mash_based_clustering,
-                      const double &block_group_identity,
-                      const double &block_group_est_identity,
-                      const uint64_t &kmer_size,
-                      const uint64_t& min_dedup_depth_for_block_splitting,
-                      const uint64_t& min_dedup_depth_for_mash_clustering,
-                      const uint64_t &max_poa_length,
-                      const uint64_t &min_copy_length,
-                      const uint64_t &max_copy_length,
-                      const uint64_t &min_autocorr_z,
-                      const uint64_t &autocorr_stride,
-                      const bool &order_paths_from_longest,
-                      const bool &break_repeats,
-                      const uint64_t &thread_count,
+// cut and split the blocks handed out by next_block until it returns false
+// the results go to emit_block in the order of the incoming block ids; returns how many there were
+    uint64_t _break_blocks(const xg::XG &graph,
+                           const std::function<bool(uint64_t&, block_t&)>& next_block,
+                           const std::function<void(block_t&)>& emit_block,
+                           const double &length_ratio_min,
+                           const uint64_t &min_length_mash_based_clustering,
+                           const double &block_group_identity,
+                           const double &block_group_est_identity,
+                           const uint64_t &kmer_size,
+                           const uint64_t& min_dedup_depth_for_block_splitting,
+                           const uint64_t& min_dedup_depth_for_mash_clustering,
+                           const uint64_t &max_poa_length,
+                           const uint64_t &min_copy_length,
+                           const uint64_t &max_copy_length,
+                           const uint64_t &min_autocorr_z,
+                           const uint64_t &autocorr_stride,
+                           const bool &order_paths_from_longest,
+                           const bool &break_repeats,
+                           const uint64_t &thread_count,
 #ifdef POA_DEBUG
-                      const bool &write_block_to_split_fastas,
+                           const bool &write_block_to_split_fastas,
 #endif
-					  const std::string& smoothxg_iter
+                           const std::string& smoothxg_iter
     ) {
         const VectorizableHandleGraph& vec_graph = dynamic_cast<const VectorizableHandleGraph&>(graph);
 
-        std::cerr
-                << smoothxg_iter << "::break_and_split_blocks] cutting blocks that contain sequences longer than max-poa-length ("
-                << max_poa_length << ") and depth >= " << min_dedup_depth_for_block_splitting << std::endl;
-        std::cerr << std::fixed << std::setprecision(3) << smoothxg_iter << "::break_and_split_blocks] splitting "
-                  << blockset->size() << " blocks " <<
-                  "at identity " << block_group_identity << " (WFA-based clustering) and " <<
-                  "at estimated-identity " << block_group_est_identity << " (mash-based clustering)" << std::endl;
-
-        std::stringstream breaks_and_splits_banner;
-        breaks_and_splits_banner << smoothxg_iter << "::break_and_split_blocks] cutting and splitting " << blockset->size()
-                                 << " blocks:";
-        progress_meter::ProgressMeter breaks_and_splits_progress(blockset->size(), breaks_and_splits_banner.str());
-
         std::atomic<uint64_t> n_cut_blocks;
         n_cut_blocks.store(0);
 
@@ -149,35 +134,41 @@ namespace smoothxg {
         std::atomic<uint64_t> split_blocks;
         split_blocks.store(0);
 
-        atomicbitvector::atomic_bv_t block_is_ready(blockset->size());
-        std::vector<std::vector<block_t>> ready_blocks(blockset->size());
+        // broken blocks wait here until all the blocks before them have been written
+        std::mutex ready_blocks_mutex;
+        std::condition_variable ready_blocks_cv;
+        ska::flat_hash_map<uint64_t, std::vector<block_t>> ready_blocks;
+        uint64_t team_size = std::numeric_limits<uint64_t>::max();
+        uint64_t workers_done = 0;
 
-        auto *broken_blockset = new smoothxg::blockset_t();
+        uint64_t new_block_id = 0;
 
         auto write_ready_blocks_lambda = [&]() {
-            uint64_t num_blocks = block_is_ready.size();
-
             uint64_t old_block_id = 0;
-            uint64_t new_block_id = 0;
-
-            while (old_block_id < num_blocks) {
-                if (block_is_ready.test(old_block_id)) {
-                    for (auto &block : ready_blocks[old_block_id]) {
-                        broken_blockset->add_block(new_block_id++, block);
-
-                        block.path_ranges.clear();
-                        block.path_ranges.shrink_to_fit();
-                        std::vector<path_range_t>().swap(block.path_ranges);
-                    }
 
-                    ready_blocks[old_block_id].clear();
-                    ready_blocks[old_block_id].shrink_to_fit();
-                    std::vector<block_t>().swap(ready_blocks[old_block_id]);
-
-                    ++old_block_id;
-                } else {
-                    std::this_thread::sleep_for(std::chrono::nanoseconds(1));
+            std::unique_lock<std::mutex> lock(ready_blocks_mutex);
+            while (true) {
+                ready_blocks_cv.wait(lock, [&]() {
+                    return ready_blocks.count(old_block_id) || workers_done == team_size;
+                });
+                auto f = ready_blocks.find(old_block_id);
+                if (f == ready_blocks.end()) {
+                    // all the workers are done and every block has been written
+                    break;
                 }
+                std::vector<block_t> blocks;
+                blocks.swap(f->second);
+                ready_blocks.erase(f);
+                lock.unlock();
+
+                for (auto &block : blocks) {
+                    emit_block(block);
+                    ++new_block_id;
+                    std::vector<path_range_t>().swap(block.path_ranges);
+                }
+
+                ++old_block_id;
+                lock.lock();
             }
         };
         std::thread write_ready_blocks_thread(write_ready_blocks_lambda);
@@ -195,11 +186,19 @@ namespace smoothxg {
             .gap_extension = 1,
         };
 
-#pragma omp parallel for schedule(dynamic, 1) num_threads(thread_count)
-        for (uint64_t block_id = 0; block_id < blockset->size(); ++block_id) {
-            auto block = blockset->get_block(block_id);
-            uint64_t tid = omp_get_thread_num();
-            wfa::mm_allocator_t* const wfa_mm_allocator = wfa_mm_allocators[tid];
+#pragma omp parallel num_threads(thread_count)
+        {
+        uint64_t tid = omp_get_thread_num();
+        wfa::mm_allocator_t* const wfa_mm_allocator = wfa_mm_allocators[tid];
+#pragma omp single nowait
+        {
+            std::lock_guard<std::mutex> guard(ready_blocks_mutex);
+            team_size = omp_get_num_threads();
+        }
+        uint64_t block_id;
+        block_t block;
+        while (next_block(block_id, block)) {
+            std::vector<block_t> broken_blocks;
             // Cutting
             // check if we have sequences that are too long
             bool to_break = false;
@@ -221,11 +220,8 @@ namespace smoothxg {
                         // steps in id space
                         std::string seq;
                         std::string name = graph.get_path_name(graph.get_path_handle_of_step(path_range.begin));
-                        for (step_handle_t step = path_range.begin;
-                             step != path_range.end;
-                             step = graph.get_next_step(step)) {
-                            seq.append(graph.get_sequence(graph.get_handle_of_step(step)));
-                        }
+                        seq.reserve(path_range.length);
+                        graph.append_path_range_sequence(path_range.begin, path_range.end, seq);
                         if (seq.length() >= 2 * min_copy_length) {
                             //std::cerr << "on " << name << "\t" << seq.length() << std::endl;
                             std::vector<uint8_t> vec(seq.begin(), seq.end());
@@ -301,7 +297,7 @@ namespace smoothxg {
                         chopped_ranges.push_back({last_end, step, pos - last_cut});
                     }
                 }
-                block.path_ranges = chopped_ranges;
+                block.path_ranges.swap(chopped_ranges);
                 // order the path ranges from longest/shortest to shortest/longest
                 // this gets called lots of times... probably best to make it std::sort or not parallel
                 std::sort(
@@ -334,11 +330,8 @@ namespace smoothxg {
                     auto& path_range = block.path_ranges[rank];
 
                     std::string seq;
-                    for (step_handle_t step = path_range.begin;
-                         step != path_range.end;
-                         step = graph.get_next_step(step)) {
-                        seq.append(graph.get_sequence(graph.get_handle_of_step(step)));
-                    }
+                    seq.reserve(path_range.length);
+                    graph.append_path_range_sequence(path_range.begin, path_range.end, seq);
                     auto seq_rev = odgi::reverse_complement(seq);
 
                     bool new_seq = true;
@@ -522,7 +515,7 @@ namespace smoothxg {
 
                     if (groups.size() == 1) {
                         // nothing to do
-                        ready_blocks[block_id].push_back(block);
+                        broken_blocks.push_back(std::move(block));
                     } else {
                         ++split_blocks;
 
@@ -548,11 +541,11 @@ namespace smoothxg {
                             //    //new_block.max_path_length = std::max(new_block.max_path_length, path_range.length);
                             //}
 
-                            ready_blocks[block_id].push_back(new_block);
+                            broken_blocks.push_back(std::move(new_block));
 
 #ifdef POA_DEBUG
                             if (write_block_to_split_fastas) {
-                                _prepare_and_write_fasta_for_block(graph, new_block, block_id, "smoothxg_",
+                                _prepare_and_write_fasta_for_block(graph, broken_blocks.back(), block_id, "smoothxg_",
                                                                    "_" + std::to_string(i++));
                             }
 #endif
@@ -571,19 +564,25 @@ namespace smoothxg {
                     }
                 } else {
                     // the blocks is too small to be split
-                    ready_blocks[block_id].push_back(block);
+                    broken_blocks.push_back(std::move(block));
                 }
             } else {
                 // nothing to do
-                ready_blocks[block_id].push_back(block);
+                broken_blocks.push_back(std::move(block));
             }
 
-            block_is_ready.set(block_id);
-
-            breaks_and_splits_progress.increment(1);
+            {
+                std::lock_guard<std::mutex> guard(ready_blocks_mutex);
+                ready_blocks[block_id].swap(broken_blocks);
+            }
+            ready_blocks_cv.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> guard(ready_blocks_mutex);
+            ++workers_done;
+        }
+        ready_blocks_cv.notify_all();
         }
-
-        breaks_and_splits_progress.finish();
 
         std::cerr << smoothxg_iter << "::break_and_split_blocks] cut " << n_cut_blocks << " blocks of which " << n_repeat_blocks
                   << " had repeats" << std::endl;
@@ -591,17 +590,89 @@ namespace smoothxg {
 
         write_ready_blocks_thread.join();
 
-        ready_blocks.clear();
-        ready_blocks.shrink_to_fit();
-        std::vector<std::vector<block_t>>().swap(ready_blocks);
-
         //std::vector<wfa::mm_allocator_t*> wfa_mm_allocators(thread_count);
         for (auto& mm_alloc : wfa_mm_allocators) {
             wfa::mm_allocator_delete(mm_alloc);
         }
 
-        delete blockset;
-        blockset = broken_blockset;
-        blockset->index(thread_count);
+        return new_block_id;
+    }
+
+    void smoothable_broken_blocks(const xg::XG &graph,
+                                  const std::function<void(block_t&)>& emit_block,
+                                  const uint64_t& max_block_weight,
+                                  const uint64_t& max_block_path_length,
+                                  const uint64_t& max_path_jump,
+                                  const uint64_t& max_edge_jump,
+                                  const double &length_ratio_min,
+                                  const uint64_t &min_length_mash_based_clustering,
+                                  const double &block_group_identity,
+                                  const double &block_group_est_identity,
+                                  const uint64_t &kmer_size,
+                                  const uint64_t& min_dedup_depth_for_block_splitting,
+                                  const uint64_t& min_dedup_depth_for_mash_clustering,
+                                  const uint64_t &max_poa_length,
+                                  const uint64_t &min_copy_length,
+                                  const uint64_t &max_copy_length,
+                                  const uint64_t &min_autocorr_z,
+                                  const uint64_t &autocorr_stride,
+                                  const bool &order_paths_from_longest,
+                                  const bool &break_repeats,
+                                  const uint64_t &thread_count,
+#ifdef POA_DEBUG
+                                  const bool &write_block_to_split_fastas,
+#endif
+                                  const std::string& smoothxg_iter
+    ) {
+        std::cerr
+                << smoothxg_iter << "::break_and_split_blocks] cutting blocks that contain sequences longer than max-poa-length ("
+                << max_poa_length << ") and depth >= " << min_dedup_depth_for_block_splitting << std::endl;
+        std::cerr << std::fixed << std::setprecision(3) << smoothxg_iter << "::break_and_split_blocks] splitting blocks "
+                  << "at identity " << block_group_identity << " (WFA-based clustering) and " <<
+                  "at estimated-identity " << block_group_est_identity << " (mash-based clustering) as they are found" << std::endl;
+
+        // blocks flow from the block finder to the cutting and splitting threads through a bounded queue
+        block_queue_t queue(64 * std::max(thread_count, (uint64_t)1));
+        // the finder and the breakers run at the same time, so they share the thread budget
+        const uint64_t find_thread_count = std::max(thread_count / 4, (uint64_t)1);
+        const uint64_t break_thread_count = std::max(thread_count - std::min(thread_count, find_thread_count), (uint64_t)1);
+        uint64_t block_count = 0;
+
+        std::thread find_blocks_thread([&]() {
+            smoothable_blocks(graph,
+                              [&](block_t& block) {
+                                  ++block_count;
+                                  queue.push(block);
+                              },
+                              max_block_weight,
+                              max_block_path_length,
+                              max_path_jump,
+                              max_edge_jump,
+                              order_paths_from_longest,
+                              find_thread_count,
+                              smoothxg_iter);
+            queue.close();
+        });
+
+        auto next_block = [&](uint64_t& block_id, block_t& block) {
+            return queue.pop(block_id, block);
+        };
+
+        const uint64_t broken_block_count = _break_blocks(graph, next_block, emit_block,
+                                              length_ratio_min, min_length_mash_based_clustering,
+                                              block_group_identity, block_group_est_identity, kmer_size,
+                                              min_dedup_depth_for_block_splitting, min_dedup_depth_for_mash_clustering,
+                                              max_poa_length, min_copy_length, max_copy_length,
+                                              min_autocorr_z, autocorr_stride,
+                                              order_paths_from_longest, break_repeats, break_thread_count,
+#ifdef POA_DEBUG
+                                              write_block_to_split_fastas,
+#endif
+                                              smoothxg_iter);
+
+        find_blocks_thread.join();
+
+        std::cerr << smoothxg_iter << "::break_and_split_blocks] cut and split " << block_count << " blocks into "
+                  << broken_block_count << " blocks" << std::endl;
     }
 }
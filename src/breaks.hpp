@@ -9,6 +9,11 @@
 #include <vector>
 #include <numeric>
 #include <cmath>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <limits>
 #include "WFA/edit/edit_cigar.hpp"
 #include "WFA/gap_affine/affine_wavefront_align.hpp"
 #include "WFA/utils/commons.hpp"
@@ -21,28 +26,33 @@ namespace smoothxg {
 
 using namespace handlegraph;
 
-// break the path ranges at likely VNTR boundaries
-// and break the path ranges to be shorter than our "max" sequence size input to spoa
-void break_blocks(const xg::XG& graph,
-                  blockset_t*& blockset,
-                  const double &length_ratio_min,
-                  const uint64_t& min_length_mash_based_clustering,
-                  const double& block_group_identity,
-                  const double& block_group_est_identity,
-                  const uint64_t& kmer_size,
-                  const uint64_t& min_dedup_depth_for_block_splitting,
-                  const uint64_t& min_dedup_depth_for_mash_clustering,
-                  const uint64_t& max_poa_length,
-                  const uint64_t& min_copy_length,
-                  const uint64_t& max_copy_length,
-                  const uint64_t& min_autocorr_z,
-                  const uint64_t& autocorr_stride,
-                  const bool& order_paths_from_longest,
-                  const bool& break_repeats,
-                  const uint64_t& thread_count,
+// find the smoothable blocks and cut and split them as they are found, breaking the path ranges
+// at likely VNTR boundaries and to be shorter than our "max" sequence size input to spoa;
+// the resulting blocks go to emit_block in block id order as soon as they are ready
+void smoothable_broken_blocks(const xg::XG& graph,
+                              const std::function<void(block_t&)>& emit_block,
+                              const uint64_t& max_block_weight,
+                              const uint64_t& max_block_path_length,
+                              const uint64_t& max_path_jump,
+                              const uint64_t& max_edge_jump,
+                              const double &length_ratio_min,
+                              const uint64_t& min_length_mash_based_clustering,
+                              const double& block_group_identity,
+                              const double& block_group_est_identity,
+                              const uint64_t& kmer_size,
+                              const uint64_t& min_dedup_depth_for_block_splitting,
+                              const uint64_t& min_dedup_depth_for_mash_clustering,
+                              const uint64_t& max_poa_length,
+                              const uint64_t& min_copy_length,
+                              const uint64_t& max_copy_length,
+                              const uint64_t& min_autocorr_z,
+                              const uint64_t& autocorr_stride,
+                              const bool& order_paths_from_longest,
+                              const bool& break_repeats,
+                              const uint64_t& thread_count,
 #ifdef POA_DEBUG
-                  const bool& write_block_to_split_fastas,
+                              const bool& write_block_to_split_fastas,
 #endif
-				  const std::string& smoothxg_iter);
+                              const std::string& smoothxg_iter);
 
 }
@@ -0,0 +1,215 @@
+#include "gfa_reader.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <system_error>
+#include <sys/stat.h>
+#include <omp.h>
+
+namespace xg {
+
+// find the end of the tab-delimited field starting at p
+inline const char* field_end(const char* p, const char* line_end) {
+    const char* e = (const char*)std::memchr(p, '\t', line_end - p);
+    return e == nullptr ? line_end : e;
+}
+
+// parse a decimal node id, bailing out as std::stol would on garbage
+inline nid_t parse_id(const char* b, const char* e) {
+    if (b == e) {
+        std::cerr << "[xg::GFAReader] error: empty node id in GFA record" << std::endl;
+        exit(1);
+    }
+    nid_t id = 0;
+    for (const char* p = b; p != e; ++p) {
+        if (*p < '0' || *p > '9') {
+            std::cerr << "[xg::GFAReader] error: node id " << std::string(b, e)
+                      << " is not a positive integer" << std::endl;
+            exit(1);
+        }
+        id = id * 10 + (*p - '0');
+    }
+    return id;
+}
+
+GFAReader::GFAReader(const std::string& gfa_filename, const uint64_t& num_threads) : num_threads(num_threads) {
+    struct stat gfa_stat;
+    if (stat(gfa_filename.c_str(), &gfa_stat) == 0 && gfa_stat.st_size == 0) {
+        // an empty file can't be mapped, and has no records anyway
+        return;
+    }
+    std::error_code error;
+    gfa.map(gfa_filename, error);
+    if (error) {
+        std::cerr << "[xg::GFAReader] error: could not memory-map " << gfa_filename
+                  << ": " << error.message() << std::endl;
+        exit(1);
+    }
+    scan(num_threads);
+}
+
+GFAReader::~GFAReader() {
+    gfa.unmap();
+}
+
+void GFAReader::scan(const uint64_t& num_threads) {
+    const char* data = gfa.data();
+    const uint64_t size = gfa.size();
+
+    // split the mapping into line-aligned chunks, several per thread to balance the load
+    const uint64_t num_chunks = std::max((uint64_t)1, std::min(size, std::max((uint64_t)1, num_threads) * 8));
+    std::vector<uint64_t> chunk_starts(num_chunks + 1, size);
+    chunk_starts[0] = 0;
+    for (uint64_t k = 1; k < num_chunks; ++k) {
+        uint64_t pos = std::max(k * size / num_chunks, chunk_starts[k-1]);
+        if (pos > 0 && pos < size && data[pos-1] != '\n') {
+            const char* nl = (const char*)std::memchr(data + pos, '\n', size - pos);
+            pos = nl == nullptr ? size : (nl - data) + 1;
+        }
+        chunk_starts[k] = pos;
+    }
+
+    std::vector<std::vector<node_record_t>> chunk_nodes(num_chunks);
+    std::vector<std::vector<edge_record_t>> chunk_edges(num_chunks);
+    std::vector<std::vector<path_record_t>> chunk_paths(num_chunks);
+
+#pragma omp parallel for schedule(dynamic,1) num_threads(num_threads)
+    for (uint64_t k = 0; k < num_chunks; ++k) {
+        auto& local_nodes = chunk_nodes[k];
+        auto& local_edges = chunk_edges[k];
+        auto& local_paths = chunk_paths[k];
+        const char* p = data + chunk_starts[k];
+        const char* chunk_end = data + chunk_starts[k+1];
+        while (p < chunk_end) {
+            const char* nl = (const char*)std::memchr(p, '\n', (data + size) - p);
+            const char* line_end = nl == nullptr ? data + size : nl;
+            const char* next = nl == nullptr ? data + size : nl + 1;
+            if (line_end > p && *(line_end - 1) == '\r') {
+                --line_end;
+            }
+            if (line_end - p > 2 && p[1] == '\t') {
+                const char type = p[0];
+                const char* f1 = p + 2;
+                const char* f1_end = field_end(f1, line_end);
+                const char* f2 = f1_end < line_end ? f1_end + 1 : line_end;
+                const char* f2_end = field_end(f2, line_end);
+                if (type == 'S') {
+                    local_nodes.push_back({parse_id(f1, f1_end),
+                                           (uint64_t)(f2 - data),
+                                           (uint64_t)(f2_end - f2)});
+                } else if (type == 'L') {
+                    // L from +/- to +/- overlap
+                    const char* f3 = f2_end < line_end ? f2_end + 1 : line_end;
+                    const char* f3_end = field_end(f3, line_end);
+                    const char* f4 = f3_end < line_end ? f3_end + 1 : line_end;
+                    if (f1 != f1_end && f2 != f2_end && f3 != f3_end && f4 < line_end) {
+                        const uint64_t from = (uint64_t)parse_id(f1, f1_end) << 1 | (*f2 == '-');
+                        const uint64_t to = (uint64_t)parse_id(f3, f3_end) << 1 | (*f4 == '-');
+                        local_edges.push_back({from, to});
+                    }
+                } else if (type == 'P') {
+                    std::string name(f1, f1_end);
+                    name.erase(std::remove_if(name.begin(), name.end(), [](char c) { return std::isspace(c); }), name.end());
+                    local_paths.push_back({name, (uint64_t)(f2 - data), (uint64_t)(f2_end - f2)});
+                }
+            }
+            p = next;
+        }
+    }
+
+    // stitch the chunks back together in file order
+    uint64_t total_nodes = 0, total_edges = 0, total_paths = 0;
+    for (uint64_t k = 0; k < num_chunks; ++k) {
+        total_nodes += chunk_nodes[k].size();
+        total_edges += chunk_edges[k].size();
+        total_paths += chunk_paths[k].size();
+    }
+    nodes.reserve(total_nodes);
+    edges.reserve(total_edges);
+    paths.reserve(total_paths);
+    for (uint64_t k = 0; k < num_chunks; ++k) {
+        nodes.insert(nodes.end(), chunk_nodes[k].begin(), chunk_nodes[k].end());
+        std::vector<node_record_t>().swap(chunk_nodes[k]);
+        edges.insert(edges.end(), chunk_edges[k].begin(), chunk_edges[k].end());
+        std::vector<edge_record_t>().swap(chunk_edges[k]);
+        for (auto& path : chunk_paths[k]) {
+            paths.push_back(std::move(path));
+        }
+        std::vector<path_record_t>().swap(chunk_paths[k]);
+    }
+}
+
+void GFAReader::parse_path(const path_record_t& path, std::vector<uint64_t>& steps) const {
+    const char* p = gfa.data() + path.line_offset;
+    const char* end = p + path.line_length;
+    if (path.line_length == 0 || (path.line_length == 1 && *p == '*')) {
+        return; // empty path
+    }
+    steps.reserve(std::count(p, end, ',') + 1);
+    while (p < end) {
+        const char* e = (const char*)std::memchr(p, ',', end - p);
+        if (e == nullptr) e = end;
+        if (e - p > 1) {
+            const bool is_rev = *(e - 1) == '-';
+            steps.push_back((uint64_t)parse_id(p, e - 1) << 1 | is_rev);
+        }
+        p = e + 1;
+    }
+}
+
+void GFAReader::for_each_sequence(const std::function<void(const std::string& seq, const nid_t& node_id)>& lambda) const {
+    const char* data = gfa.data();
+    std::string seq;
+    for (auto& node : nodes) {
+        seq.assign(data + node.seq_offset, node.seq_length);
+        lambda(seq, node.id);
+    }
+}
+
+void GFAReader::for_each_edge(const std::function<void(const nid_t& from, const bool& from_rev,
+                                                       const nid_t& to, const bool& to_rev)>& lambda) const {
+    for (auto& edge : edges) {
+        lambda(edge.from >> 1, edge.from & 1, edge.to >> 1, edge.to & 1);
+    }
+}
+
+void GFAReader::for_each_path_element(const std::function<void(const std::string& path_name,
+                                                               const nid_t& node_id, const bool& is_rev,
+                                                               const std::string& cigar, const bool& is_empty,
+                                                               const bool& is_circular)>& lambda) const {
+    const std::string cigar;
+    std::vector<std::vector<uint64_t>> batch_steps;
+    uint64_t begin = 0;
+    while (begin < paths.size()) {
+        // take paths up to path_batch_bytes of step text, and at least one
+        uint64_t end = begin + 1;
+        uint64_t batch_bytes = paths[begin].line_length;
+        while (end < paths.size() && batch_bytes + paths[end].line_length <= path_batch_bytes) {
+            batch_bytes += paths[end].line_length;
+            ++end;
+        }
+        batch_steps.resize(end - begin);
+#pragma omp parallel for schedule(dynamic,1) num_threads(num_threads)
+        for (uint64_t i = begin; i < end; ++i) {
+            parse_path(paths[i], batch_steps[i - begin]);
+        }
+        for (uint64_t i = begin; i < end; ++i) {
+            auto& path = paths[i];
+            auto& steps = batch_steps[i - begin];
+            if (steps.empty()) {
+                lambda(path.name, 0, false, cigar, true, false);
+            } else {
+                for (auto& step : steps) {
+                    lambda(path.name, step >> 1, step & 1, cigar, false, false);
+                }
+            }
+            // the caller has its own copy now
+            std::vector<uint64_t>().swap(steps);
+        }
+        begin = end;
+    }
+}
+
+}
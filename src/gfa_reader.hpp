@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include <mio/mmap.hpp>
+
+#include <handlegraph/types.hpp>
+
+namespace xg {
+
+using nid_t = handlegraph::nid_t;
+
+/**
+ * A GFA reader for index construction. The file is memory-mapped once and
+ * split into line-aligned chunks that are parsed in parallel. Node and path
+ * records refer back into the mapping and edges are decoded into a compact
+ * buffer. Path steps are decoded in parallel batches of paths as they are
+ * replayed, so only one batch is held at a time.
+ */
+class GFAReader {
+public:
+    GFAReader(const std::string& gfa_filename, const uint64_t& num_threads);
+    ~GFAReader();
+
+    GFAReader(const GFAReader& other) = delete;
+    GFAReader& operator=(const GFAReader& other) = delete;
+
+    /// Enumerate the S records in file order.
+    void for_each_sequence(const std::function<void(const std::string& seq, const nid_t& node_id)>& lambda) const;
+
+    /// Enumerate the L records in file order.
+    void for_each_edge(const std::function<void(const nid_t& from, const bool& from_rev,
+                                                const nid_t& to, const bool& to_rev)>& lambda) const;
+
+    /// Enumerate the steps of each P record, with paths in file order.
+    void for_each_path_element(const std::function<void(const std::string& path_name,
+                                                        const nid_t& node_id, const bool& is_rev,
+                                                        const std::string& cigar, const bool& is_empty,
+                                                        const bool& is_circular)>& lambda) const;
+
+    uint64_t node_count(void) const { return nodes.size(); }
+    uint64_t edge_count(void) const { return edges.size(); }
+    uint64_t path_count(void) const { return paths.size(); }
+
+private:
+
+    struct node_record_t {
+        nid_t id;
+        uint64_t seq_offset; // into the mapping
+        uint64_t seq_length;
+    };
+
+    struct edge_record_t {
+        uint64_t from; // id << 1 | is_rev
+        uint64_t to;
+    };
+
+    struct path_record_t {
+        std::string name;
+        uint64_t line_offset; // start of the steps field
+        uint64_t line_length;
+    };
+
+    /// Parse the S, L and P line headers in line-aligned chunks of the mapping.
+    void scan(const uint64_t& num_threads);
+
+    /// Decode the steps of a path into steps, as id << 1 | is_rev.
+    void parse_path(const path_record_t& path, std::vector<uint64_t>& steps) const;
+
+    /// The step text decoded per batch of paths in for_each_path_element.
+    static const uint64_t path_batch_bytes = 64 * 1024 * 1024;
+
+    uint64_t num_threads;
+    mio::mmap_source gfa;
+    std::vector<node_record_t> nodes;
+    std::vector<edge_record_t> edges;
+    std::vector<path_record_t> paths;
+};
+
+}
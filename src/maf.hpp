@@ -18,8 +18,27 @@ struct maf_t {
     std::vector<uint64_t> block_ids;
     ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>> rows;
     std::deque<std::pair<std::string, maf_partial_row_t>> consensus_rows;
+    // for each path, the rank of the first row starting or ending at each position on each strand
+    ska::flat_hash_map<std::string, ska::flat_hash_map<uint64_t, uint64_t>> row_bounds;
 };
 
+inline uint64_t maf_row_bound_key(const uint64_t& position, const bool& is_reversed, const bool& is_end) {
+    return position << 2 | (uint64_t)is_reversed << 1 | (uint64_t)is_end;
+}
+
+// rebuild the row bounds of a path after its rows changed
+inline void index_maf_rows(maf_t& maf, const std::string& path_name) {
+    auto& bounds = maf.row_bounds[path_name];
+    bounds.clear();
+    const auto& rows = maf.rows[path_name];
+    for (uint64_t rank = 0; rank < rows.size(); ++rank) {
+        const auto& row = rows[rank];
+        // emplace keeps the first row
+        bounds.emplace(maf_row_bound_key(row.record_start, row.is_reversed, false), rank);
+        bounds.emplace(maf_row_bound_key(row.record_start + row.seq_size, row.is_reversed, true), rank);
+    }
+}
+
 template<typename T>
 inline void clear_vector(std::vector<T>& vec) {
     vec.clear();
@@ -69,6 +69,8 @@ int main(int argc, char **argv) {
                                                  {'j', "path-jump-max"});
     args::ValueFlag<std::string> _max_edge_jump(block_comp_opts, "N", "maximum edge jump before breaking (1k = 1K = 1000, 1m = 1M = 10^6, 1g = 1G = 10^9) [default: 0 / off]",
                                                 {'e', "edge-jump-max"});
+    args::ValueFlag<std::string> _max_blockset_memory(block_comp_opts, "N", "keep the blocks waiting for POA in memory while they take up to this many bytes, spilling them to disk beyond it (1k = 1K = 1000, 1m = 1M = 10^6, 1g = 1G = 10^9) [default: 4G]",
+                                                      {"blockset-memory-max"});
 
     args::Group copy_length_opts(parser, "[ Copy Length Options ]");
     args::ValueFlag<std::string> _min_copy_length(copy_length_opts, "N", "minimum repeat length to collapse (1k = 1K = 1000, 1m = 1M = 10^6, 1g = 1G = 10^9) [default: 1000]",
@@ -121,6 +123,11 @@ int main(int argc, char **argv) {
     args::Flag change_alignment_mode(poa_opts, "change-alignment-mode",
                                      "change the alignment mode to global [default: local]",
                                      {'Z', "change-alignment-mode"});
+    args::ValueFlag<uint64_t> _block_graph_dict_samples(poa_opts, "N",
+                                                        "train a compression dictionary on the first N smoothed block graphs and use it to keep the following ones in memory, 0 to disable it [default: 1000]",
+                                                        {"block-graph-dict-samples"});
+    args::ValueFlag<std::string> _max_block_graph_memory(poa_opts, "N", "keep the compressed smoothed block graphs in memory while they take up to this many bytes, spilling them to disk beyond it (1k = 1K = 1000, 1m = 1M = 10^6, 1g = 1G = 10^9) [default: 4G]",
+                                                         {"block-graph-memory-max"});
 
     args::Group consensus_opts(parser, "[ Consensus Graph(s) Options ]");
     args::ValueFlag<std::string> _ref_paths(consensus_opts, "FILE",
@@ -172,6 +179,7 @@ int main(int argc, char **argv) {
     args::Group threading_opts(parser, "[ Threading ]");
     args::ValueFlag<uint64_t> num_threads(threading_opts, "N", "use this many threads during parallel steps", {'t', "threads"});
     args::ValueFlag<uint64_t> num_poa_threads(threading_opts, "N", "use this many POA threads (can be used to reduce memory requirements with large --poa-length-target settings) [default: --threads]", {'T', "poa-threads"});
+    args::ValueFlag<std::string> _max_poa_memory(threading_opts, "N", "only start a POA while the estimated memory of all the running ones stays under this many bytes, letting small blocks use every thread and big ones run with fewer (1k = 1K = 1000, 1m = 1M = 10^6, 1g = 1G = 10^9) [default: 0 / off]", {"poa-memory-max"});
 
 	args::Group program_info_opts(parser, "[ Program Information ]");
 	args::Flag version(program_info_opts, "version", "report the current version including the github commit hash", {'v', "version"});
@@ -201,6 +209,10 @@ int main(int argc, char **argv) {
     size_t n_threads = num_threads ? args::get(num_threads) : 1;
     omp_set_num_threads(n_threads);
     size_t n_poa_threads = num_poa_threads ? args::get(num_poa_threads) : n_threads;
+    const uint64_t max_poa_memory = _max_poa_memory ? (uint64_t)smoothxg::handy_parameter(args::get(_max_poa_memory), 0) : 0;
+    const uint64_t block_graph_dict_samples = _block_graph_dict_samples ? args::get(_block_graph_dict_samples) : smoothxg::DEFAULT_BLOCK_GRAPH_DICT_SAMPLES;
+    const uint64_t max_block_graph_memory = _max_block_graph_memory ?
+            (uint64_t)smoothxg::handy_parameter(args::get(_max_block_graph_memory), smoothxg::DEFAULT_BLOCK_GRAPH_MEMORY_MAX) : smoothxg::DEFAULT_BLOCK_GRAPH_MEMORY_MAX;
 
     std::string smoothed_out_gfa = args::get(smoothed_out);
     std::vector<std::string> consensus_path_names;
@@ -270,6 +282,8 @@ int main(int argc, char **argv) {
         const double contiguous_path_jaccard = _contiguous_path_jaccard ? min(args::get(_contiguous_path_jaccard), 1.0) : 1.0;
 		const uint64_t max_block_jump = _max_block_jump ? (uint64_t)smoothxg::handy_parameter(args::get(_max_block_jump), 100) : 100;
         const uint64_t max_edge_jump = _max_edge_jump ? (uint64_t)smoothxg::handy_parameter(args::get(_max_edge_jump), 0) : 0;
+        const uint64_t max_blockset_memory = _max_blockset_memory ?
+                (uint64_t)smoothxg::handy_parameter(args::get(_max_blockset_memory), smoothxg::DEFAULT_BLOCKSET_MEMORY_MAX) : smoothxg::DEFAULT_BLOCKSET_MEMORY_MAX;
         const uint64_t min_copy_length = _min_copy_length ? (uint64_t)smoothxg::handy_parameter(args::get(_min_copy_length), 1000) : 1000;
         const uint64_t max_copy_length = _max_copy_length ? (uint64_t)smoothxg::handy_parameter(args::get(_max_copy_length), 20000) : 20000;
 		std::vector<string> target_poa_lengths;
@@ -358,6 +372,9 @@ int main(int argc, char **argv) {
         const uint64_t num_iterations = target_poa_lengths.size();
 		const uint64_t n_haps = args::get(_n_haps);
 
+        // the smoothed graph of each iteration but the last is handed to the next one in memory
+        std::unique_ptr<odgi::graph_t> smoothed_prev;
+
         // It assumes that either xg_in or gfa_in is set
         for (uint64_t current_iter = 0; current_iter < num_iterations; ++current_iter) {
 			const uint64_t target_poa_length = (uint64_t)smoothxg::handy_parameter(target_poa_lengths[current_iter], 4000);
@@ -375,63 +392,77 @@ int main(int argc, char **argv) {
                 std::ifstream in(args::get(xg_in));
                 graph->deserialize(in);
             } else {
-                std::string gfa_in_name;
+                // later iterations start from the previous iteration's smoothed graph, kept in memory
+                std::unique_ptr<odgi::graph_t> prepped = std::move(smoothed_prev);
                 if (!args::get(no_prep)) {
-                    if (args::get(tmp_base).empty()) {
-                        gfa_in_name = path_input_gfa + ".prep." + std::to_string(current_iter) + ".gfa";
+                    // prep in memory and build the xg index directly from the prepped graph,
+                    // writing the prepped GFA only if we've been asked to keep temporary files
+                    std::cerr << smoothxg_iter << "::main] prepping graph for smoothing" << std::endl;
+                    if (prepped) {
+                        smoothxg::prep(*prepped, node_chop,
+                                       term_updates, true, temp_file::get_dir() + '/', n_threads,
+                                       smoothxg_iter);
                     } else {
-                        const std::string filename = filesystem::path(path_input_gfa).filename();
-                        gfa_in_name = args::get(tmp_base) + '/' + filename + ".prep." + std::to_string(current_iter) + ".gfa";
+                        prepped = std::make_unique<odgi::graph_t>();
+                        smoothxg::prep(args::get(gfa_in), *prepped, node_chop,
+                                       term_updates, true, temp_file::get_dir() + '/', n_threads,
+                                       smoothxg_iter);
+                    }
+                    if (args::get(keep_temp)) {
+                        std::string gfa_prep_name;
+                        if (args::get(tmp_base).empty()) {
+                            gfa_prep_name = path_input_gfa + ".prep." + std::to_string(current_iter) + ".gfa";
+                        } else {
+                            const std::string filename = filesystem::path(path_input_gfa).filename();
+                            gfa_prep_name = args::get(tmp_base) + '/' + filename + ".prep." + std::to_string(current_iter) + ".gfa";
+                        }
+                        smoothxg::write_prepped_gfa(*prepped, gfa_prep_name, smoothxg_iter);
                     }
-                    std::cerr << smoothxg_iter << "::main] prepping graph for smoothing" << std::endl;
-                    smoothxg::prep(args::get(gfa_in), gfa_in_name, node_chop,
-								   term_updates, true, temp_file::get_dir() + '/', n_threads,
-								   smoothxg_iter);
-                } else {
-                    gfa_in_name = path_input_gfa;
                 }
                 std::cerr << smoothxg_iter << "::main] building xg index" << std::endl;
-                graph->from_gfa(gfa_in_name, false, temp_file::get_dir() + '/');
-                if (!args::get(keep_temp) && !args::get(no_prep)) {
-                    std::remove(gfa_in_name.c_str());
+                if (prepped) {
+                    graph->from_path_handle_graph(*prepped, false, temp_file::get_dir() + '/', n_threads);
+                } else {
+                    graph->from_gfa(path_input_gfa, false, temp_file::get_dir() + '/', n_threads);
                 }
             }
 
-            auto *blockset = new smoothxg::blockset_t();
-            smoothxg::smoothable_blocks(*graph,
-                                        *blockset,
-                                        max_block_weight,
-                                        target_poa_length,
-                                        max_block_jump,
-                                        max_edge_jump,
-                                        order_paths_from_longest,
-                                        num_threads,
-										smoothxg_iter);
-
             const uint64_t min_autocorr_z = 5;
             const uint64_t autocorr_stride = 50;
 
-            smoothxg::break_blocks(*graph,
-                                   blockset,
-                                   block_length_ratio_min,
-                                   min_length_mash_based_clustering,
-                                   block_group_identity,
-                                   block_group_est_identity,
-                                   kmer_size,
-                                   min_dedup_depth_for_block_splitting,
-                                   min_dedup_depth_for_mash_clustering,
-                                   max_poa_length,
-                                   min_copy_length,
-                                   max_copy_length,
-                                   min_autocorr_z,
-                                   autocorr_stride,
-                                   order_paths_from_longest,
-                                   true,
-                                   n_threads,
+            // blocks are smoothed as soon as they are cut and split, coming through a bounded queue
+            // that holds back the block finder and the breakers when POA falls behind
+            smoothxg::block_queue_t broken_blocks(64 * (uint64_t)n_poa_threads);
+            std::thread break_blocks_thread([&]() {
+                smoothxg::smoothable_broken_blocks(*graph,
+                                                   [&](smoothxg::block_t& block) {
+                                                       broken_blocks.push(block);
+                                                   },
+                                                   max_block_weight,
+                                                   target_poa_length,
+                                                   max_block_jump,
+                                                   max_edge_jump,
+                                                   block_length_ratio_min,
+                                                   min_length_mash_based_clustering,
+                                                   block_group_identity,
+                                                   block_group_est_identity,
+                                                   kmer_size,
+                                                   min_dedup_depth_for_block_splitting,
+                                                   min_dedup_depth_for_mash_clustering,
+                                                   max_poa_length,
+                                                   min_copy_length,
+                                                   max_copy_length,
+                                                   min_autocorr_z,
+                                                   autocorr_stride,
+                                                   order_paths_from_longest,
+                                                   true,
+                                                   n_threads,
 #ifdef POA_DEBUG
-                                   args::get(write_block_to_split_fastas),
+                                                   args::get(write_block_to_split_fastas),
 #endif
-								   smoothxg_iter);
+                                                   smoothxg_iter);
+                broken_blocks.close();
+            });
 
             // build the path_step_rank_ranges -> index_in_blocks_vector
             // flat_hash_map using SKA: KEY: path_name, VALUE: sorted interval_tree using cgranges https://github.com/lh3/cgranges:
@@ -493,7 +524,11 @@ int main(int argc, char **argv) {
 
             {
                 auto smoothed = smoothxg::smooth_and_lace(*graph,
-                                                          blockset,
+                                                          [&](smoothxg::block_t& block) {
+                                                              uint64_t block_id;
+                                                              return broken_blocks.pop(block_id, block);
+                                                          },
+                                                          max_blockset_memory,
                                                           poa_m,
                                                           poa_n,
                                                           poa_g,
@@ -507,6 +542,9 @@ int main(int argc, char **argv) {
                                                           local_alignment,
                                                           n_threads,
                                                           n_poa_threads,
+                                                          max_poa_memory,
+                                                          block_graph_dict_samples,
+                                                          max_block_graph_memory,
                                                           (current_iter == num_iterations - 1) ? args::get(write_msa_in_maf_format) : "", maf_header,
                                                           args::get(merge_blocks), args::get(_preserve_unmerged_consensus),
                                                           contiguous_path_jaccard,
@@ -519,6 +557,7 @@ int main(int argc, char **argv) {
 #endif
                                                           max_merged_groups_in_memory,
 														  smoothxg_iter);
+                break_blocks_thread.join();
 
                 std::cerr << smoothxg_iter << "::main] unchopping smoothed graph" << std::endl;
                 odgi::algorithms::unchop(*smoothed, n_threads, true);
@@ -548,16 +587,21 @@ int main(int argc, char **argv) {
                     path_smoothed_gfa = smoothed_out_gfa;
                 }
 
-                std::cerr << smoothxg_iter << "::main] writing smoothed graph to " << path_smoothed_gfa << std::endl;
-                ofstream out(path_smoothed_gfa.c_str());
-                smoothed->to_gfa(out);
-                out.close();
-                delete smoothed;
+                // intermediate smoothed graphs are only written if we're keeping temporary files
+                if (current_iter == num_iterations - 1 || args::get(keep_temp)) {
+                    std::cerr << smoothxg_iter << "::main] writing smoothed graph to " << path_smoothed_gfa << std::endl;
+                    ofstream out(path_smoothed_gfa.c_str());
+                    smoothed->to_gfa(out);
+                    out.close();
+                }
+                if (current_iter < num_iterations - 1) {
+                    smoothed_prev.reset(smoothed);
+                } else {
+                    delete smoothed;
+                }
 
                 path_input_gfa = path_smoothed_gfa;
             }
-
-            delete blockset;
         }
 
         // do we need to write the consensus path names?
@@ -605,7 +649,7 @@ int main(int argc, char **argv) {
         if (_read_consensus_path_names) {
             std::string smoothed_in_gfa = args::get(_smoothed_in_gfa);
             smoothed_xg.from_gfa(smoothed_in_gfa, false,
-                                 args::get(tmp_base).empty() ? smoothed_in_gfa : args::get(tmp_base));
+                                 args::get(tmp_base).empty() ? smoothed_in_gfa : args::get(tmp_base), n_threads);
             std::ifstream file(args::get(_read_consensus_path_names));
             std::string path_name;
             while (std::getline(file, path_name)) {
@@ -613,7 +657,7 @@ int main(int argc, char **argv) {
             }
         } else {
             smoothed_xg.from_gfa(smoothed_out_gfa, false,
-                                 args::get(tmp_base).empty() ? smoothed_out_gfa : args::get(tmp_base));
+                                 args::get(tmp_base).empty() ? smoothed_out_gfa : args::get(tmp_base), n_threads);
         }
         for (auto &spec : consensus_specs) {
             //for (auto jump_max : jump_maxes) {
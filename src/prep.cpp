@@ -17,9 +17,41 @@ void prep(
     const uint64_t& num_threads,
 	const std::string& smoothxg_iter) {
 
-    // load it into an odgi
     odgi::graph_t graph;
+    prep(gfa_in, graph, max_node_length, p_sgd_min_term_updates, toposort, basename, num_threads, smoothxg_iter);
+
+    write_prepped_gfa(graph, gfa_out, smoothxg_iter);
+}
+
+// load the GFA and prep it in memory, leaving the result in the given graph
+
+void prep(
+    const std::string& gfa_in,
+    odgi::graph_t& graph,
+    const uint64_t& max_node_length,
+    const float& p_sgd_min_term_updates,
+    const bool& toposort,
+    const std::string& basename,
+    const uint64_t& num_threads,
+	const std::string& smoothxg_iter) {
+
+    // load it into an odgi
     odgi::gfa_to_handle(gfa_in, &graph, true, num_threads, true);
+
+    prep(graph, max_node_length, p_sgd_min_term_updates, toposort, basename, num_threads, smoothxg_iter);
+}
+
+// sort and chop an already loaded graph in place
+
+void prep(
+    odgi::graph_t& graph,
+    const uint64_t& max_node_length,
+    const float& p_sgd_min_term_updates,
+    const bool& toposort,
+    const std::string& basename,
+    const uint64_t& num_threads,
+	const std::string& smoothxg_iter) {
+
     graph.set_number_of_threads(num_threads);
 
     // sort it using a short sorting pipeline equivalent to `odgi sort -p Ygs`
@@ -142,12 +174,17 @@ void prep(
     std::cerr << smoothxg_iter << "::prep] chopping graph to " << max_node_length << std::endl;
     // chop it (preserves order)
     odgi::algorithms::chop(graph, max_node_length, num_threads, true);
+}
+
+void write_prepped_gfa(
+    const odgi::graph_t& graph,
+    const std::string& gfa_out,
+    const std::string& smoothxg_iter) {
 
     std::cerr << smoothxg_iter << "::prep] writing graph " << gfa_out << std::endl;
     std::ofstream f(gfa_out);
     graph.to_gfa(f);
     f.close();
-
 }
 
 }
@@ -32,4 +32,35 @@ void prep(
     const uint64_t& num_threads,
 	const std::string& smoothxg_iter);
 
+// load and prep the graph in memory, leaving the sorted and chopped result in graph
+// this lets us build the xg index directly from it, skipping the GFA round trip
+
+void prep(
+    const std::string& gfa_in,
+    odgi::graph_t& graph,
+    const uint64_t& max_node_length,
+    const float& p_sgd_min_term_updates,
+    const bool& toposort,
+    const std::string& basename,
+    const uint64_t& num_threads,
+	const std::string& smoothxg_iter);
+
+// sort and chop an already loaded graph in place
+
+void prep(
+    odgi::graph_t& graph,
+    const uint64_t& max_node_length,
+    const float& p_sgd_min_term_updates,
+    const bool& toposort,
+    const std::string& basename,
+    const uint64_t& num_threads,
+	const std::string& smoothxg_iter);
+
+// write the prepped graph as GFA
+
+void write_prepped_gfa(
+    const odgi::graph_t& graph,
+    const std::string& gfa_out,
+    const std::string& smoothxg_iter);
+
 }
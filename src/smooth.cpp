@@ -76,7 +76,9 @@ void append_to_sequence(const xg::XG &graph,
     const step_handle_t final_step = on_the_left ? graph.path_begin(path_handle) : graph.path_end(path_handle);
 
     uint64_t characters_to_add = poa_padding;
+    // on the right the padding goes straight into seq, on the left it has to follow the Ns
     std::string tmp;
+    std::string& padding = on_the_left ? tmp : seq;
     //ToDo: check if the condition is right
     while (step != final_step && characters_to_add > 0){
         const auto h = graph.get_handle_of_step(step);
@@ -85,14 +87,11 @@ void append_to_sequence(const xg::XG &graph,
         uint64_t characters_added;
         if (l <= characters_to_add) {
             // Take the full seq
-            tmp.append(graph.get_sequence(h));
+            graph.append_sequence(h, padding);
             characters_added = l;
         }else {
             // Take only the characters needed
-            graph.get_sequence(h).substr(graph.get_sequence(h).size() - characters_to_add);
-            tmp.append(
-                    graph.get_sequence(h).substr(graph.get_sequence(h).size() - characters_to_add)
-            );
+            graph.append_subsequence(h, l - characters_to_add, characters_to_add, padding);
             characters_added = characters_to_add;
         }
         if (graph.get_is_reverse(h)) {
@@ -106,24 +105,10 @@ void append_to_sequence(const xg::XG &graph,
     }
 
     if (on_the_left){
-        //std::cerr << graph.get_path_name(path_handle) << " - HEAD: ";
-        while (characters_to_add > 0) {
-            seq.append("N");
-            //std::cerr << "N";
-            --characters_to_add;
-        }
-        //std::cerr << tmp << std::endl;
+        seq.append(characters_to_add, 'N');
         seq.append(tmp);
     } else {
-        //std::cerr << graph.get_path_name(path_handle) << " - TAIL: " << tmp;
-        seq.append(tmp);
-
-        while (characters_to_add > 0) {
-            seq.append("N");
-            //std::cerr << "N";
-            --characters_to_add;
-        }
-        //std::cerr << "\n";
+        seq.append(characters_to_add, 'N');
     }
 }
 
@@ -132,6 +117,159 @@ void append_to_sequence(const xg::XG &graph,
 
 #include "xxHash/xxhash.h"
 
+spoa::AlignmentEngine* spoa_context_t::get_engine(const bool& local_alignment,
+                                                  std::int8_t poa_m, std::int8_t poa_n, std::int8_t poa_g,
+                                                  std::int8_t poa_e, std::int8_t poa_q, std::int8_t poa_c,
+                                                  const uint64_t& max_sequence_size) {
+    auto engine_key = std::make_tuple(local_alignment, poa_m, poa_n, poa_g, poa_e, poa_q, poa_c);
+    if (!_engine || engine_key != _engine_key) {
+        // free the old matrices before the new engine allocates its own
+        _engine.reset();
+        _engine = spoa::AlignmentEngine::Create(
+            local_alignment ? spoa::AlignmentType::kSW : spoa::AlignmentType::kNW,
+            poa_m, poa_n, poa_g, poa_e, poa_q, poa_c);
+        _engine_key = engine_key;
+        _max_sequence_size = 0;
+    }
+    if (max_sequence_size > _max_sequence_size) {
+        // grow once to the longest sequence seen, rather than step by step while aligning
+        _engine->Prealloc(max_sequence_size, 4);
+        _max_sequence_size = max_sequence_size;
+    }
+    return _engine.get();
+}
+
+void spoa_context_t::set_max_retained_memory(const uint64_t& max_retained_memory) {
+    _max_retained_memory = max_retained_memory;
+}
+
+void spoa_context_t::trim(const uint64_t& graph_nodes) {
+    if (!_engine) {
+        return;
+    }
+    // the matrices also grow past the preallocated rows when the graph gets larger
+    const uint64_t retained_memory = std::max(estimate_spoa_memory(1, _max_sequence_size),
+                                              graph_nodes * _max_sequence_size * 5 * sizeof(int32_t));
+    if (retained_memory > _max_retained_memory) {
+        _engine.reset();
+        _max_sequence_size = 0;
+    }
+}
+
+abpoa_context_t::~abpoa_context_t() {
+    if (_ab != nullptr) {
+        abpoa_free(_ab);
+    }
+    if (_abpt != nullptr) {
+        abpoa_free_para(_abpt);
+    }
+}
+
+abpoa_para_t* abpoa_context_t::get_para(const bool& local_alignment, const bool& banded_alignment,
+                                        const bool& add_consensus, const bool& generate_msa,
+                                        int poa_m, int poa_n, int poa_g,
+                                        int poa_e, int poa_q, int poa_c) {
+    auto para_key = std::make_tuple(local_alignment, banded_alignment, add_consensus, generate_msa,
+                                    poa_m, poa_n, poa_g, poa_e, poa_q, poa_c);
+    if (_abpt == nullptr || para_key != _para_key) {
+        if (_abpt != nullptr) {
+            abpoa_free_para(_abpt);
+        }
+        // initialize abPOA parameters
+        _abpt = abpoa_init_para();
+
+        // if we want to do local alignments
+        if (local_alignment) {
+            _abpt->align_mode = ABPOA_LOCAL_MODE;
+        } else {
+            _abpt->align_mode = ABPOA_GLOBAL_MODE;
+        }
+        // _abpt->zdrop = -1;     // disable zdrop
+        // _abpt->end_bonus = -1; // disable end bouns
+        if (!banded_alignment) {
+            _abpt->wb = -1;
+        } else {
+            _abpt->wb = 311;
+        }
+        _abpt->wf = 0.03; // hmm
+        _abpt->amb_strand = 0; //we align based on orientation relative to the graph
+        // _abpt->ret_cigar = 1;  // return cigar
+        _abpt->rev_cigar = 0;  // reverse cigar
+        _abpt->out_cons = add_consensus;
+        // _abpt->out_fq = 0;     // output consensus sequence in fastq
+        _abpt->out_gfa = 1; // must be set to get the graph
+        _abpt->out_msa = generate_msa ? 1 : 0; // must be set when we extract the MSA
+        // _abpt->max_n_cons = 1; // number of max. generated consensus sequence
+
+        // score matrix
+        _abpt->match = poa_m;
+        _abpt->mismatch = poa_n;
+        _abpt->gap_open1 = poa_g;
+        _abpt->gap_open2 = poa_q;
+        _abpt->gap_ext1 = poa_e;
+        _abpt->gap_ext2 = poa_c;
+
+        _abpt->disable_seeding = 1; // disable seeding (allow seeding greatly reduces runtime and memory, but reducing the accuracy)
+
+        _abpt->k = 19;
+        _abpt->w = 10;
+        _abpt->min_w = 3313;
+        // _abpt->progressive_poa = 0; // progressive partial order alignment
+
+        // finalize parameters
+        abpoa_post_set_para(_abpt);
+
+        _para_key = para_key;
+    }
+    return _abpt;
+}
+
+abpoa_t* abpoa_context_t::get_abpoa(void) {
+    if (_ab == nullptr) {
+        _ab = abpoa_init();
+    }
+    return _ab;
+}
+
+void abpoa_context_t::set_max_retained_memory(const uint64_t& max_retained_memory) {
+    _max_retained_memory = max_retained_memory;
+}
+
+void abpoa_context_t::trim(const uint64_t& last_block_memory) {
+    // abPOA's buffers only ever grow, so after a big block they stay that big until freed
+    if (_ab != nullptr && last_block_memory > _max_retained_memory) {
+        abpoa_free(_ab);
+        _ab = nullptr;
+    }
+}
+
+// nodes a POA graph reaches: it grows by about a tenth of a sequence for each sequence after the first
+static uint64_t poa_graph_nodes(const uint64_t& n_seqs, const uint64_t& max_sequence_size) {
+    return max_sequence_size + (n_seqs - 1) * (max_sequence_size / 10);
+}
+
+// five 32-bit scores per cell for the convex gap model, plus the graph and the sequences
+static uint64_t poa_dp_memory(const uint64_t& n_seqs, const uint64_t& max_sequence_size,
+                              const uint64_t& rows, const uint64_t& columns) {
+    return rows * columns * 5 * sizeof(int32_t) + rows * 64 + n_seqs * max_sequence_size;
+}
+
+uint64_t estimate_abpoa_memory(const uint64_t& n_seqs, const uint64_t& max_sequence_size, const bool& banded_alignment) {
+    const uint64_t graph_nodes = poa_graph_nodes(n_seqs, max_sequence_size);
+    // banded abPOA (wb = 311, wf = 0.03) only fills the cells around the diagonal
+    const uint64_t columns = banded_alignment
+            ? std::min(max_sequence_size, 2 * (311 + max_sequence_size * 3 / 100) + 1)
+            : max_sequence_size;
+    return poa_dp_memory(n_seqs, max_sequence_size, graph_nodes, columns);
+}
+
+uint64_t estimate_spoa_memory(const uint64_t& n_seqs, const uint64_t& max_sequence_size) {
+    // Prealloc(max_sequence_size, 4) sizes the matrices for four graph nodes per base,
+    // and they only grow from there if the graph gets larger
+    const uint64_t rows = std::max(4 * max_sequence_size, poa_graph_nodes(n_seqs, max_sequence_size));
+    return poa_dp_memory(n_seqs, max_sequence_size, rows, max_sequence_size);
+}
+
 odgi::graph_t* smooth_abpoa(const xg::XG &graph, const block_t &block, const uint64_t block_id,
                             int poa_m, int poa_n, int poa_g,
                             int poa_e, int poa_q, int poa_c,
@@ -139,6 +277,8 @@ odgi::graph_t* smooth_abpoa(const xg::XG &graph, const block_t &block, const uin
                             bool local_alignment,
                             std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>>& maf, bool keep_sequence,
                             bool banded_alignment,
+                            abpoa_context_t& abpoa_context,
+                            poa_memory_gate_t* poa_memory_gate,
 							const std::string& smoothxg_iter,
 #ifdef POA_DEBUG
                             const uint64_t save_block_fastas,
@@ -170,6 +310,7 @@ odgi::graph_t* smooth_abpoa(const xg::XG &graph, const block_t &block, const uin
         auto &path_range = block.path_ranges[i];
 
         std::string seq;
+        seq.reserve(path_range.length + 2 * poa_padding);
         uint64_t fwd_bp = 0;
         uint64_t rev_bp = 0;
         const path_handle_t path_handle = graph.get_path_handle_of_step(path_range.begin);
@@ -184,7 +325,7 @@ odgi::graph_t* smooth_abpoa(const xg::XG &graph, const block_t &block, const uin
              step = graph.get_next_step(step)) {
             const auto h = graph.get_handle_of_step(step);
             const auto l = graph.get_length(h);
-            seq.append(graph.get_sequence(h));
+            graph.append_sequence(h, seq);
             if (graph.get_is_reverse(h)) {
                 rev_bp += l;
             } else {
@@ -243,54 +384,18 @@ odgi::graph_t* smooth_abpoa(const xg::XG &graph, const block_t &block, const uin
         return output_graph;
     }
 
-    const bool add_consensus = !consensus_name.empty();
+    // wait until there is room for this block's alignment
+    const uint64_t poa_memory = estimate_abpoa_memory(seqs.size(), max_sequence_size, banded_alignment);
+    if (poa_memory_gate != nullptr) {
+        poa_memory_gate->acquire(poa_memory);
+    }
 
-    // initialize abPOA parameters
-    abpoa_para_t *abpt = abpoa_init_para();
+    const bool add_consensus = !consensus_name.empty();
 
-    // if we want to do local alignments
-    if (local_alignment) {
-        abpt->align_mode = ABPOA_LOCAL_MODE;
-    } else {
-        abpt->align_mode = ABPOA_GLOBAL_MODE;
-    }
-    // abpt->zdrop = -1;     // disable zdrop
-    // abpt->end_bonus = -1; // disable end bouns
-    if (!banded_alignment) {
-        abpt->wb = -1;
-    } else {
-        abpt->wb = 311;
-    }
-    abpt->wf = 0.03; // hmm
-    abpt->amb_strand = 0; //we align based on orientation relative to the graph
-    // abpt->ret_cigar = 1;  // return cigar
-    abpt->rev_cigar = 0;  // reverse cigar
-    abpt->out_cons = add_consensus;
-    // abpt->out_fq = 0;     // output consensus sequence in fastq
-    abpt->out_gfa = 1; // must be set to get the graph
-    abpt->out_msa = maf != nullptr ? 1 : 0; // must be set when we extract the MSA
-    // abpt->max_n_cons = 1; // number of max. generated consensus sequence
-
-    // score matrix
-    abpt->match = poa_m;
-    abpt->mismatch = poa_n;
-    abpt->gap_open1 = poa_g;
-    abpt->gap_open2 = poa_q;
-    abpt->gap_ext1 = poa_e;
-    abpt->gap_ext2 = poa_c;
-
-    abpt->disable_seeding = 1; // disable seeding (allow seeding greatly reduces runtime and memory, but reducing the accuracy)
-
-    abpt->k = 19;
-    abpt->w = 10;
-    abpt->min_w = 3313;
-    // abpt->progressive_poa = 0; // progressive partial order alignment
-
-    // finalize parameters
-    abpoa_post_set_para(abpt);
-
-    // initialize abPOA
-    abpoa_t *ab = abpoa_init();
+    abpoa_para_t *abpt = abpoa_context.get_para(local_alignment, banded_alignment,
+                                                add_consensus, maf != nullptr,
+                                                poa_m, poa_n, poa_g, poa_e, poa_q, poa_c);
+    abpoa_t *ab = abpoa_context.get_abpoa();
 
     // alloc our seq count
      // collect sequence length, transform ACGT to 0123
@@ -530,8 +635,6 @@ odgi::graph_t* smooth_abpoa(const xg::XG &graph, const block_t &block, const uin
 
     odgi::graph_t block_graph;
     build_odgi_abPOA(ab, abpt, &block_graph, dup_seq_names, poa_padding, dup_is_revs, consensus_name, add_consensus);
-    abpoa_free(ab);
-    abpoa_free_para(abpt);
 
     // normalize the representation, allowing for nodes > 1bp
     //auto graph_copy = output_graph;
@@ -616,6 +719,12 @@ odgi::graph_t* smooth_abpoa(const xg::XG &graph, const block_t &block, const uin
     ///output_graph->to_gfa(a);
     ///a.close();
 
+    if (poa_memory_gate != nullptr) {
+        // the gate stops counting this block's buffers here, so only keep what is allowed
+        abpoa_context.trim(poa_memory);
+        poa_memory_gate->release(poa_memory);
+    }
+
     return output_graph;
 }
 
@@ -626,6 +735,8 @@ odgi::graph_t* smooth_spoa(const xg::XG &graph, const block_t &block,
                            int poa_padding,
                            bool local_alignment,
                            std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>>& maf, bool keep_sequence,
+                           spoa_context_t& spoa_context,
+                           poa_memory_gate_t* poa_memory_gate,
 						   const std::string& smoothxg_iter,
 #ifdef POA_DEBUG
                            uint64_t save_block_fastas,
@@ -660,6 +771,7 @@ odgi::graph_t* smooth_spoa(const xg::XG &graph, const block_t &block,
             auto &path_range = block.path_ranges[i];
 
             std::string seq;
+            seq.reserve(path_range.length + 2 * poa_padding);
             uint64_t fwd_bp = 0;
             uint64_t rev_bp = 0;
             const path_handle_t path_handle = graph.get_path_handle_of_step(path_range.begin);
@@ -674,7 +786,7 @@ odgi::graph_t* smooth_spoa(const xg::XG &graph, const block_t &block,
                                step = graph.get_next_step(step)) {
                 const auto h = graph.get_handle_of_step(step);
                 const auto l = graph.get_length(h);
-                seq.append(graph.get_sequence(h));
+                graph.append_sequence(h, seq);
                 if (graph.get_is_reverse(h)) {
                     rev_bp += l;
                 } else {
@@ -733,12 +845,17 @@ odgi::graph_t* smooth_spoa(const xg::XG &graph, const block_t &block,
             return output_graph;
         }
 
-        auto spoa_algorithm = local_alignment ? spoa::AlignmentType::kSW : spoa::AlignmentType::kNW;
-        auto alignment_engine = spoa::AlignmentEngine::Create(
-            spoa_algorithm,
-            poa_m, poa_n, poa_g, poa_e, poa_q, poa_c);
+        // wait until there is room for this block's alignment
+        const uint64_t poa_memory = estimate_spoa_memory(seqs.size(), max_sequence_size);
+        if (poa_memory_gate != nullptr) {
+            poa_memory_gate->acquire(poa_memory);
+        }
+
+        auto* alignment_engine = spoa_context.get_engine(local_alignment,
+                                                         poa_m, poa_n, poa_g, poa_e, poa_q, poa_c,
+                                                         max_sequence_size);
 
-        spoa::Graph poa_graph{};
+        spoa::Graph poa_graph;
 
         int i = 0;
         for (auto &seq : seqs) {
@@ -1068,6 +1185,12 @@ odgi::graph_t* smooth_spoa(const xg::XG &graph, const block_t &block,
 #endif
     }*/
 
+    if (poa_memory_gate != nullptr) {
+        // the gate stops counting this block's matrices here, so only keep what is allowed
+        spoa_context.trim(poa_graph.nodes().size());
+        poa_memory_gate->release(poa_memory);
+    }
+
     // output_graph.to_gfa(out);
     return output_graph;
 }
@@ -1075,7 +1198,7 @@ odgi::graph_t* smooth_spoa(const xg::XG &graph, const block_t &block,
 void _put_block_in_group(
         maf_t &merged_maf_blocks, uint64_t block_id, uint64_t num_seq_in_block,
         std::string consensus_name,
-        std::vector<std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>>> &mafs,
+        std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>> &maf_block,
         bool new_block_on_the_left,
         bool flip_block_before_merging
 ){
@@ -1086,7 +1209,7 @@ void _put_block_in_group(
     std::string gaps = "";
     for (uint64_t j = 0; j < alignment_size_merged_maf_blocks; j++){ gaps += "-"; }
 
-    for (const auto& path_to_maf_rows : *mafs[block_id]) {
+    for (const auto& path_to_maf_rows : *maf_block) {
         // Do not check the consensus (always forward)
         if (path_to_maf_rows.first != consensus_name){
             if (merged_maf_blocks.rows.count(path_to_maf_rows.first) == 0) {
@@ -1218,7 +1341,7 @@ void _put_block_in_group(
     // The merged consensus is created when the merged block is written into a file
     if (!consensus_name.empty()){
         // IMPORTANT: it assumes a single consensus sequence!
-        auto &maf_row = (*mafs[block_id])[consensus_name][0];
+        auto &maf_row = (*maf_block)[consensus_name][0];
 
         //uint64_t maf_row_record_start = flip_block_before_merging ? maf_row.path_length - (maf_row.record_start + maf_row.seq_size) : maf_row.record_start;
         if (flip_block_before_merging) {
@@ -1253,7 +1376,7 @@ void _put_block_in_group(
     // Put gaps for paths not present in the last merged block (block_id) respect to the merged group
 
     // I take the length from a one of the path present in the last merged block
-    uint64_t num_gaps_to_add = mafs[block_id]->begin()->second[0].aligned_seq.size();
+    uint64_t num_gaps_to_add = maf_block->begin()->second[0].aligned_seq.size();
     alignment_size_merged_maf_blocks += num_gaps_to_add;
 
     for (uint64_t  i = 0; i < num_gaps_to_add; i++){ gaps += "-"; }
@@ -1286,6 +1409,13 @@ void _put_block_in_group(
 
     clear_string(gaps);
 
+    // only the rows of the paths in the new block changed their coordinates
+    for (const auto& path_to_maf_rows : *maf_block) {
+        if (path_to_maf_rows.first != consensus_name) {
+            index_maf_rows(merged_maf_blocks, path_to_maf_rows.first);
+        }
+    }
+
     if (new_block_on_the_left){
         merged_maf_blocks.block_ids.insert(merged_maf_blocks.block_ids.begin(), block_id);
     } else {
@@ -1527,8 +1657,86 @@ void _write_merged_maf_blocks(
     */
 }
 
+// order the blocks by their estimated POA cost, heaviest first, so that the
+// deep and long blocks don't end up running alone at the end of the pass
+std::vector<uint64_t> _blocks_by_poa_cost(const blockset_t *blockset, int n_threads) {
+    std::vector<std::pair<uint64_t, uint64_t>> cost_and_id(blockset->size());
+#pragma omp parallel for schedule(dynamic,1024) num_threads(n_threads)
+    for (uint64_t block_id = 0; block_id < blockset->size(); ++block_id) {
+        // depth times the mean sequence length
+        cost_and_id[block_id] = std::make_pair(blockset->block_length_sum(block_id), block_id);
+    }
+    ips4o::parallel::sort(
+        cost_and_id.begin(), cost_and_id.end(),
+        [&](const std::pair<uint64_t, uint64_t> &a, const std::pair<uint64_t, uint64_t> &b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+    std::vector<uint64_t> order;
+    order.reserve(cost_and_id.size());
+    for (auto &c : cost_and_id) {
+        order.push_back(c.second);
+    }
+    return order;
+}
+
+// walk a path of the input graph and its copy in the smoothed graph in lockstep, one node at a time,
+// returning the offset of the first base where they differ, or max if they spell the same sequence;
+// on mismatch, the sequences of both paths from there to the end of their current nodes are returned
+uint64_t _first_path_mismatch(const xg::XG &graph, const path_handle_t &orig_path,
+                              const odgi::graph_t &smoothed, const path_handle_t &smoothed_path,
+                              std::string &orig_context, std::string &smoothed_context) {
+    uint64_t orig_steps_left = graph.get_step_count(orig_path);
+    uint64_t smoothed_steps_left = smoothed.get_step_count(smoothed_path);
+    step_handle_t orig_step = graph.path_begin(orig_path);
+    step_handle_t smoothed_step = smoothed.path_begin(smoothed_path);
+    std::string orig_node, smoothed_node;
+    uint64_t orig_offset = 0, smoothed_offset = 0;
+    uint64_t position = 0;
+    while (true) {
+        if (orig_offset == orig_node.size() && orig_steps_left > 0) {
+            orig_node.clear();
+            graph.append_sequence(graph.get_handle_of_step(orig_step), orig_node);
+            orig_offset = 0;
+            if (--orig_steps_left > 0) {
+                orig_step = graph.get_next_step(orig_step);
+            }
+            continue;
+        }
+        if (smoothed_offset == smoothed_node.size() && smoothed_steps_left > 0) {
+            smoothed_node = smoothed.get_sequence(smoothed.get_handle_of_step(smoothed_step));
+            smoothed_offset = 0;
+            if (--smoothed_steps_left > 0) {
+                smoothed_step = smoothed.get_next_step(smoothed_step);
+            }
+            continue;
+        }
+        const uint64_t orig_left = orig_node.size() - orig_offset;
+        const uint64_t smoothed_left = smoothed_node.size() - smoothed_offset;
+        if (orig_left == 0 || smoothed_left == 0) {
+            if (orig_left == smoothed_left) {
+                return std::numeric_limits<uint64_t>::max();
+            }
+            break; // one is longer than the other
+        }
+        const uint64_t n = std::min(orig_left, smoothed_left);
+        auto diff = std::mismatch(orig_node.begin() + orig_offset, orig_node.begin() + orig_offset + n,
+                                  smoothed_node.begin() + smoothed_offset);
+        const uint64_t same = diff.first - (orig_node.begin() + orig_offset);
+        orig_offset += same;
+        smoothed_offset += same;
+        position += same;
+        if (same < n) {
+            break;
+        }
+    }
+    orig_context = orig_node.substr(orig_offset);
+    smoothed_context = smoothed_node.substr(smoothed_offset);
+    return position;
+}
+
 odgi::graph_t* smooth_and_lace(const xg::XG &graph,
-                               blockset_t*& blockset,
+                               const std::function<bool(block_t&)>& next_block,
+                               uint64_t max_blockset_memory,
                                int poa_m, int poa_n,
                                int poa_g, int poa_e,
                                int poa_q, int poa_c,
@@ -1539,6 +1747,9 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                bool local_alignment,
                                int n_threads,
                                int n_poa_threads,
+                               uint64_t max_poa_memory,
+                               uint64_t block_graph_dict_samples,
+                               uint64_t max_block_graph_memory,
                                const std::string &path_output_maf, std::string &maf_header,
                                bool merge_blocks, bool preserve_unmerged_consensus, double contiguous_path_jaccard,
                                bool use_abpoa,
@@ -1555,34 +1766,71 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
     //
     // record the start and end points of all the path ranges and the consensus
     //
-    uint64_t block_count = blockset->size();
-    auto _block_graphs = std::make_unique<std::vector<std::string*>>(block_count, nullptr);
+    // the blocks arrive while they are being cut and split, so we only know how many there are at the end
+    uint64_t block_count = 0;
+    auto _block_graphs = std::make_unique<block_graph_store_t>(block_count, max_block_graph_memory);
     auto& block_graphs = *_block_graphs; // get a ref
 
+    // block graphs are alike, so once we have seen enough of them we train a dictionary on
+    // them and use it to compress all the following ones
+    std::unique_ptr<zstdutil::Dictionary> _block_graph_dict;
+    std::atomic<const zstdutil::Dictionary*> block_graph_dict(nullptr);
+    std::mutex block_graph_dict_samples_mutex;
+    std::vector<std::string> block_graph_dict_samples_data;
+    uint64_t block_graph_dict_samples_bytes = 0;
+    bool sampling_block_graphs = block_graph_dict_samples > 0;
+
+    auto sample_block_graph =
+        [&](const std::string& data) {
+            std::vector<std::string> samples;
+            {
+                std::lock_guard<std::mutex> guard(block_graph_dict_samples_mutex);
+                if (!sampling_block_graphs) {
+                    return;
+                }
+                block_graph_dict_samples_data.push_back(data);
+                block_graph_dict_samples_bytes += data.size();
+                // zstd suggests about 100 times the dictionary size as training input
+                if (block_graph_dict_samples_data.size() < block_graph_dict_samples
+                    && block_graph_dict_samples_bytes < 100 * zstdutil::DEFAULTDICTCAPACITY) {
+                    return;
+                }
+                sampling_block_graphs = false;
+                samples.swap(block_graph_dict_samples_data);
+            }
+            // train outside the lock, the other threads keep compressing without the dictionary meanwhile
+            auto dict = std::make_unique<zstdutil::Dictionary>(samples);
+            if (dict->ok()) {
+                _block_graph_dict = std::move(dict);
+                block_graph_dict.store(_block_graph_dict.get());
+            }
+        };
+
     auto get_block_graph =
         [&](const uint64_t& block_id) {
-            std::string data;
-            zstdutil::DecompressString(*block_graphs[block_id], data);
-            stringstream ss;
-            ss << data;
-            ss.seekg(0,std::ios_base::beg);
-            auto block_graph = std::make_unique<odgi::graph_t>();
-            block_graph->deserialize_members(ss);
-            return block_graph;
+            std::string record, data;
+            block_graphs.get(block_id, record);
+            const zstdutil::Dictionary* dict = block_graph_dict.load();
+            if (dict != nullptr) {
+                zstdutil::DecompressString(record, data, *dict);
+            } else {
+                zstdutil::DecompressString(record, data);
+            }
+            return block_graph_t(std::move(data));
         };
 
     auto save_block_graph =
         [&](const uint64_t& block_id,
-            const odgi::graph_t* block_graph) {
-            std::stringstream ss;
-            block_graph->serialize_members(ss);
-            std::string*& s = block_graphs[block_id];
-            if (s == nullptr) {
-                s = new std::string;
+            const block_graph_t& block_graph) {
+            std::string record;
+            const zstdutil::Dictionary* dict = block_graph_dict.load();
+            if (dict != nullptr) {
+                zstdutil::CompressString(block_graph.data(), record, *dict);
             } else {
-                s->clear();
+                zstdutil::CompressString(block_graph.data(), record);
+                sample_block_graph(block_graph.data());
             }
-            zstdutil::CompressString(ss.str(), *s);
+            block_graphs.put(block_id, std::move(record));
         };
 
     // mapping from path fragments to block graphs
@@ -1592,19 +1840,22 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
     path_mapping.open_writer();
 
     // mapping from block to consensus ids
-    std::vector<path_handle_t> consensus_mapping(add_consensus ? blockset->size() : 0);
+    std::vector<path_handle_t> consensus_mapping;
+
+    // node count of each block graph, giving the node id range of each block in the smoothed graph
+    std::vector<uint64_t> block_node_counts;
 
     std::vector<IITree<uint64_t, uint64_t>> merged_block_id_intervals_tree_vector;
     std::vector<std::string> block_id_ranges_vector;
     ska::flat_hash_set<uint64_t> inverted_merged_block_id_intervals_ranks; // IITree can't store inverted intervals
 
-    std::atomic<uint64_t> num_flipped_graphs(0);
-    atomicbitvector::atomic_bv_t blok_to_flip(blockset->size());
+    // the MAF writer decides which block graphs to flip and which blocks end up in merged groups
+    std::vector<uint64_t> blocks_to_flip;
 
-    std::vector<bool> is_block_in_a_merged_group((add_consensus && merge_blocks) ? blockset->size() : 0);
+    std::vector<bool> is_block_in_a_merged_group;
 
 #ifdef POA_DEBUG
-    std::vector<ska::flat_hash_map<std::string, std::string>> block2stats(blockset->size());
+    std::vector<ska::flat_hash_map<std::string, std::string>> block2stats;
 #endif
 
     {
@@ -1612,8 +1863,12 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
 
         // If merged consensus sequences have to be embedded, this structures are needed to keep the blocks' coordinates,
         // but the sequences will be considered (and kept in memory) only if a MAF has to be produced
-        std::vector<std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>>> mafs(produce_maf || (add_consensus && merge_blocks) ? blockset->size() : 0);
-        atomicbitvector::atomic_bv_t mafs_ready(produce_maf || (add_consensus && merge_blocks) ? blockset->size() : 0);
+        // the MAF rows of the smoothed blocks that the writer hasn't reached yet, by block id;
+        // the writer sleeps until the next block in order is ready, or all the blocks are done
+        ska::flat_hash_map<uint64_t, std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>>> ready_mafs;
+        bool poa_done = false;
+        std::mutex mafs_ready_mutex;
+        std::condition_variable mafs_ready_cv;
 
         auto write_maf_lambda = [&]() {
             if (produce_maf || (add_consensus && merge_blocks)) {
@@ -1621,8 +1876,6 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
 
                 std::deque<std::unique_ptr<maf_t>> merged_maf_blocks_queue;
 
-                uint64_t num_blocks = blockset->size();
-
                 std::ofstream out_maf;
 
                 if (produce_maf) {
@@ -1630,12 +1883,27 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                     out_maf << maf_header << std::endl;
                 }
 
-                while (block_id < num_blocks) {
-                    if (mafs_ready.test(block_id)) {
+                while (true) {
+                    std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>> maf_block;
+                    {
+                        std::unique_lock<std::mutex> lock(mafs_ready_mutex);
+                        mafs_ready_cv.wait(lock, [&]() { return ready_mafs.count(block_id) || poa_done; });
+                        auto f = ready_mafs.find(block_id);
+                        if (f == ready_mafs.end()) {
+                            // every block has been smoothed, and we've been through all of them
+                            break;
+                        }
+                        maf_block = std::move(f->second);
+                        ready_mafs.erase(f);
+                    }
+                    if (add_consensus && merge_blocks) {
+                        is_block_in_a_merged_group.push_back(false);
+                    }
+                    {
                         //std::cerr << "block_id (" << block_id << ")" << std::endl;
 
-                        uint64_t num_seq_in_block = mafs[block_id]->size();
-                        //for (auto const& path_to_maf_rows : mafs[block_id]) { num_seq_in_block += path_to_maf_rows.second.size(); }
+                        uint64_t num_seq_in_block = maf_block->size();
+                        //for (auto const& path_to_maf_rows : maf_block) { num_seq_in_block += path_to_maf_rows.second.size(); }
 
                         bool merged = false;
                         bool prep_new_merge_group = false;
@@ -1675,7 +1943,7 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                         merged = true;
                                         num_contiguous_ranges = 0;
 
-                                        for (auto const& path_to_maf_rows : *mafs[block_id]) {
+                                        for (auto const& path_to_maf_rows : *maf_block) {
                                             // Do not check the consensus (always forward)
                                             if (path_to_maf_rows.first != consensus_name){
                                                 // To merge a block, it has to contains new sequences...
@@ -1686,64 +1954,29 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                                     for (auto &maf_row : path_to_maf_rows.second) {
                                                         uint64_t maf_row_record_start = flip_block ? maf_row.path_length - (maf_row.record_start + maf_row.seq_size) : maf_row.record_start;
 
-                                                        for (auto &merged_maf_prow : merged_maf_blocks.rows[path_to_maf_rows.first]) {
-                                                            if ((flip_block ^ maf_row.is_reversed) == merged_maf_prow.is_reversed) {
-                                                                if (flip_block ^ maf_row.is_reversed) {
-                                                                    if ((merged_maf_prow.path_length - merged_maf_prow.record_start) ==
-                                                                        (maf_row.path_length - (maf_row_record_start + maf_row.seq_size))) {
-                                                                        // merged_maf_row_end == maf_row_begin, new row on the right
-
-                                                                        if (new_block_on_the_left == -1 || new_block_on_the_left == 1) {
-                                                                            // the row is the first one, or the merge continues on the left
-
-                                                                            new_block_on_the_left = 1;
-
-                                                                            found_contiguous_row = true;
-                                                                            num_contiguous_ranges += 1;
-                                                                            break;
-                                                                        }
-                                                                    } else if ((maf_row.path_length - maf_row_record_start) ==
-                                                                               (merged_maf_prow.path_length - (merged_maf_prow.record_start + merged_maf_prow.seq_size))) {
-                                                                        // maf_row_end == merged_maf_row_begin, new row on the left
-
-                                                                        if (new_block_on_the_left == -1 || new_block_on_the_left == 0) {
-                                                                            // the row is the first one, or the merge continues on the right
-
-                                                                            new_block_on_the_left = 0;
-
-                                                                            found_contiguous_row = true;
-                                                                            num_contiguous_ranges += 1;
-                                                                            break;
-                                                                        }
-                                                                    }
-                                                                } else {
-                                                                    if ((merged_maf_prow.record_start + merged_maf_prow.seq_size) == maf_row_record_start) {
-                                                                        // merged_maf_row_end == maf_row_begin, new row on the right
-
-                                                                        if (new_block_on_the_left == -1 || new_block_on_the_left == 0) {
-                                                                            // the row is the first one, or the merge continues on the right
-
-                                                                            new_block_on_the_left = 0;
-
-                                                                            found_contiguous_row = true;
-                                                                            num_contiguous_ranges += 1;
-                                                                            break;
-                                                                        }
-                                                                    } else if ((maf_row_record_start + maf_row.seq_size) == merged_maf_prow.record_start) {
-                                                                        // maf_row_end == merged_maf_row_begin, new row on the left
-
-                                                                        if (new_block_on_the_left == -1 || new_block_on_the_left == 1) {
-                                                                            // the row is the first one, or the merge continues on the left
-
-                                                                            new_block_on_the_left = 1;
-
-                                                                            found_contiguous_row = true;
-                                                                            num_contiguous_ranges += 1;
-                                                                            break;
-                                                                        }
-                                                                    }
-                                                                }
-                                                            }
+                                                        const bool is_reversed = flip_block ^ maf_row.is_reversed;
+                                                        const auto& bounds = merged_maf_blocks.row_bounds.at(path_to_maf_rows.first);
+                                                        // on the same strand, a merged row ending where this one starts puts the new block on the
+                                                        // right, and a merged row starting where this one ends puts it on the left
+                                                        auto ends_at_start = bounds.find(maf_row_bound_key(maf_row_record_start, is_reversed, true));
+                                                        auto starts_at_end = bounds.find(maf_row_bound_key(maf_row_record_start + maf_row.seq_size, is_reversed, false));
+                                                        const int8_t ends_at_start_side = 0;
+                                                        const int8_t starts_at_end_side = 1;
+
+                                                        // the row is the first one, or the merge has to continue on the same side
+                                                        const uint64_t no_row = std::numeric_limits<uint64_t>::max();
+                                                        const uint64_t ends_at_start_rank =
+                                                                ends_at_start != bounds.end() && (new_block_on_the_left == -1 || new_block_on_the_left == ends_at_start_side)
+                                                                ? ends_at_start->second : no_row;
+                                                        const uint64_t starts_at_end_rank =
+                                                                starts_at_end != bounds.end() && (new_block_on_the_left == -1 || new_block_on_the_left == starts_at_end_side)
+                                                                ? starts_at_end->second : no_row;
+                                                        if (ends_at_start_rank != no_row || starts_at_end_rank != no_row) {
+                                                            // the first contiguous merged row wins, as when scanning them in order
+                                                            new_block_on_the_left = ends_at_start_rank < starts_at_end_rank ? ends_at_start_side : starts_at_end_side;
+
+                                                            found_contiguous_row = true;
+                                                            num_contiguous_ranges += 1;
                                                         }
 
                                                         // Commented out because we want to check if all ranges are mergeable
@@ -1763,7 +1996,7 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                             for (const auto &maf_prows : merged_maf_blocks.rows) { num_ranges_in_merged_block += maf_prows.second.size(); }
 
                                             uint64_t num_ranges_in_block_to_merge = 0;
-                                            for (const auto &maf_prows : *mafs[block_id]) { num_ranges_in_block_to_merge += maf_prows.second.size(); }
+                                            for (const auto &maf_prows : *maf_block) { num_ranges_in_block_to_merge += maf_prows.second.size(); }
 
                                             double current_contiguous_path_jaccard =
                                                     (double) num_contiguous_ranges /
@@ -1800,16 +2033,15 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                             auto& merged_maf_blocks = merged_maf_blocks_queue[index_group_where_merge];
 
                             _put_block_in_group(
-                                    *merged_maf_blocks, block_id, num_seq_in_block, consensus_name, mafs,
+                                    *merged_maf_blocks, block_id, num_seq_in_block, consensus_name, maf_block,
                                     new_block_on_the_left_in_the_group == 1,
                                     flip_block_before_merging_in_the_group);
 
-                            //_clear_maf_block(mafs[block_id]);
-                            mafs[block_id].reset(nullptr);
+                            //_clear_maf_block(maf_block);
+                            maf_block.reset(nullptr);
 
                             if (flip_block_before_merging_in_the_group) {
-                                blok_to_flip.set(block_id);
-                                ++num_flipped_graphs;
+                                blocks_to_flip.push_back(block_id);
                             }
                         }
 
@@ -1836,13 +2068,13 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                             // quietly groom by flipping the block to prefer the forward orientation of the lowest-ranked path
                             //
 
-                            auto block_graph = get_block_graph(block_id);
+                            const block_graph_t block_graph = get_block_graph(block_id);
                             uint64_t first_id = std::numeric_limits<uint64_t>::max();
                             path_handle_t groom_target_path;
-                            block_graph->for_each_path_handle(
+                            block_graph.for_each_path_handle(
                                 [&](const path_handle_t& p) {
-                                    auto name_range = block_graph->get_path_name(p);
-                                    auto path_name = name_range.substr(0, name_range.find_last_of('_'));
+                                    auto name_range = block_graph.get_path_name(p);
+                                    std::string path_name(name_range.substr(0, name_range.find_last_of('_')));
                                     uint64_t id = as_integer(graph.get_path_handle(path_name));
                                     if (id < first_id) {
                                         groom_target_path = p;
@@ -1850,9 +2082,8 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                     }
                                 });
                             assert(first_id < std::numeric_limits<uint64_t>::max());
-                            bool flip_block = block_graph->get_is_reverse(
-                                block_graph->get_handle_of_step(
-                                    block_graph->path_begin(groom_target_path)));
+                            bool flip_block = block_graph_t::get_is_reverse(
+                                block_graph.get_handle_of_step(groom_target_path, 0));
 
                             // Put the current block in a new group on the right
                             merged_maf_blocks_queue.push_back(std::make_unique<maf_t>());
@@ -1860,13 +2091,13 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
 
                             // The last merge failed and the current un-merged block becomes the first one of the next group
                             _put_block_in_group(
-                                    *merged_maf_blocks, block_id, num_seq_in_block, consensus_name, mafs,
+                                    *merged_maf_blocks, block_id, num_seq_in_block, consensus_name, maf_block,
                                     false,
                                     flip_block);
 
-                            //_clear_maf_block(mafs[block_id]);
-                            //delete mafs[block_id];
-                            mafs[block_id].reset(nullptr);
+                            //_clear_maf_block(maf_block);
+                            //delete maf_block;
+                            maf_block.reset(nullptr);
                         }
 
                         block_id++;
@@ -1890,15 +2121,13 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
 
                                     out_maf << "a blocks=" + std::to_string(block_id) << " loops="
                                             << (contains_loops ? "true" : "false") << std::endl;
-                                    write_maf_rows(out_maf, mafs[block_id]);
+                                    write_maf_rows(out_maf, maf_block);
                                 }
 
-                                _clear_maf_block(mafs[block_id]);
+                                _clear_maf_block(maf_block);
                             }
                         }*/
                     }
-
-                    std::this_thread::sleep_for(std::chrono::nanoseconds(1));
                 }
 
                 while (!merged_maf_blocks_queue.empty()) {
@@ -1928,28 +2157,36 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
         };
         std::thread write_maf_thread(write_maf_lambda);
 
-        std::stringstream poa_banner;
-        poa_banner << smoothxg_iter << "::smooth_and_lace] applying "
-                   << (local_alignment ? "local" : "global") << " "
-                   << (use_abpoa ? "abPOA" : "SPOA")
-                   << " to " << blockset->size() << " blocks:";
-        progress_meter::ProgressMeter poa_progress(blockset->size(), poa_banner.str());
+        // we don't know how many blocks are coming, so the block finder's progress stands in for ours,
+        // as the queues between us keep it from getting far ahead
+        std::cerr << smoothxg_iter << "::smooth_and_lace] applying "
+                  << (local_alignment ? "local" : "global") << " "
+                  << (use_abpoa ? "abPOA" : "SPOA")
+                  << " to the blocks as they are cut and split" << std::endl;
         std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>> empty_maf_block(nullptr);
+        std::vector<spoa_context_t> spoa_contexts(use_abpoa ? 0 : n_poa_threads);
+        std::vector<abpoa_context_t> abpoa_contexts(use_abpoa ? n_poa_threads : 0);
+        std::unique_ptr<poa_memory_gate_t> poa_memory_gate(max_poa_memory > 0 ? new poa_memory_gate_t(max_poa_memory) : nullptr);
+        if (max_poa_memory > 0) {
+            // engines kept between blocks are outside the gate, so each thread keeps at most its share
+            for (auto& spoa_context : spoa_contexts) {
+                spoa_context.set_max_retained_memory(max_poa_memory / n_poa_threads);
+            }
+            for (auto& abpoa_context : abpoa_contexts) {
+                abpoa_context.set_max_retained_memory(max_poa_memory / n_poa_threads);
+            }
+        }
 
-        // Smooth blocks
-#pragma omp parallel for schedule(dynamic,1) num_threads(n_poa_threads)
-        for (uint64_t block_id = 0; block_id < blockset->size(); ++block_id) {
-            auto block = blockset->get_block(block_id);
-
+        auto smooth_block = [&](const uint64_t& block_id, const block_t& block) {
             std::string consensus_name;
             if (add_consensus){
                 consensus_name = consensus_base_name + std::to_string(block_id);
             }
 
-            // std::cerr << "on block " << block_id+1 << " of " << blockset->size() << std::endl;
             odgi::graph_t* block_graph = nullptr;
+            std::unique_ptr<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>> maf_block;
             if (produce_maf || (add_consensus && merge_blocks)) {
-                mafs[block_id] = std::make_unique<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>>();
+                maf_block = std::make_unique<ska::flat_hash_map<std::string, std::vector<maf_partial_row_t>>>();
             }
 
             int poa_padding = 0;
@@ -1995,9 +2232,8 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                 std::vector<std::string* > seqs; seqs.reserve(block.path_ranges.size());
                 for (const auto& path_range : block.path_ranges) {
                     auto seq = new std::string();
-                    for (step_handle_t step = path_range.begin; step != path_range.end; step = graph.get_next_step(step)) {
-                        seq->append(graph.get_sequence(graph.get_handle_of_step(step)));
-                    }
+                    seq->reserve(path_range.length);
+                    graph.append_path_range_sequence(path_range.begin, path_range.end, *seq);
 
                     // We can't compute the hashes for what is shorter than the kmer size
                     // Skip too short sequences
@@ -2094,9 +2330,11 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                            poa_padding,
                                            // abPOA local mode is buggy, so when we use abPOA instead of SPOA, go global
                                            local_alignment /*&& !(!use_abpoa && block.path_ranges.size() > MAX_POA_BLOCK_DEPTH)*/,
-                                           (produce_maf || (add_consensus && merge_blocks)) ? mafs[block_id] : empty_maf_block,
+                                           (produce_maf || (add_consensus && merge_blocks)) ? maf_block : empty_maf_block,
                                            produce_maf,
                                            true, // banded alignment
+                                           abpoa_contexts[omp_get_thread_num()],
+                                           poa_memory_gate.get(),
 										   smoothxg_iter,
 #ifdef POA_DEBUG
                                            write_fasta_blocks,
@@ -2115,8 +2353,10 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                           -poa_c_to_use,
                                           poa_padding,
                                           local_alignment,
-                                          (produce_maf || (add_consensus && merge_blocks)) ? mafs[block_id] : empty_maf_block,
+                                          (produce_maf || (add_consensus && merge_blocks)) ? maf_block : empty_maf_block,
                                           produce_maf,
+                                          spoa_contexts[omp_get_thread_num()],
+                                          poa_memory_gate.get(),
 										  smoothxg_iter,
 #ifdef POA_DEBUG
                                           write_fasta_blocks,
@@ -2145,6 +2385,7 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
 
             for (auto &path_range : block.path_ranges) {
                 auto seq = new std::string();
+                seq->reserve(path_range.length + 2 * poa_padding);
                 uint64_t fwd_bp = 0;
                 uint64_t rev_bp = 0;
                 const path_handle_t path_handle = graph.get_path_handle_of_step(path_range.begin);
@@ -2154,13 +2395,7 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                 *seq, fwd_bp, rev_bp,
                                 poa_padding, true);
 
-                for (step_handle_t step = path_range.begin;
-                                   step != path_range.end;
-                                   step = graph.get_next_step(step)) {
-                    const auto h = graph.get_handle_of_step(step);
-                    const auto l = graph.get_length(h);
-                    seq->append(graph.get_sequence(h));
-                }
+                graph.append_path_range_sequence(path_range.begin, path_range.end, *seq);
 
                 append_to_sequence(graph,
                                 path_handle, path_range.end,
@@ -2283,7 +2518,12 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
             // std::cerr << std::endl;
             // std::cerr << "After block graph. Exiting for now....." <<
             // std::endl; exit(0);
-            if (block_graph->get_node_count() > 0) {
+            // flatten the smoothed block, which is all we need from here on
+            const block_graph_t compact_graph(*block_graph);
+            delete block_graph;
+            block_graph = nullptr;
+            block_node_counts[block_id] = compact_graph.get_node_count();
+            if (compact_graph.get_node_count() > 0) {
                 // auto& block_graph = block_graphs.back();
                 // record the start and end paths
                 // nb: the path order is the same in the input block and output
@@ -2308,18 +2548,57 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                 // record the consensus path
                 if (add_consensus) {
                     // record our consensus handle for later setup
-                    consensus_mapping[block_id] = block_graph->get_path_handle(consensus_name);
+                    consensus_mapping[block_id] = compact_graph.get_path_handle(consensus_name);
                 }
             }
-            save_block_graph(block_id, block_graph);
-            delete block_graph;
-            poa_progress.increment(1);
+            save_block_graph(block_id, compact_graph);
             if (produce_maf || (add_consensus && merge_blocks)){
-                mafs_ready.set(block_id);
+                {
+                    std::lock_guard<std::mutex> guard(mafs_ready_mutex);
+                    ready_mafs[block_id] = std::move(maf_block);
+                }
+                mafs_ready_cv.notify_one();
             }
-        }
+        };
 
-        poa_progress.finish();
+        // Smooth the blocks in windows of consecutive block ids as they arrive, heaviest first within each
+        // window; the MAF writer and the lacing still see them in block id order. Windows bound both how
+        // many blocks wait here and how many finished blocks' MAF rows wait for the writer
+        const uint64_t poa_window_size = 256 * (uint64_t)n_poa_threads;
+        block_t block;
+        bool more_blocks = true;
+        while (more_blocks) {
+            blockset_t window(max_blockset_memory);
+            while (window.size() < poa_window_size && (more_blocks = next_block(block))) {
+                window.add_block(window.size(), block);
+            }
+            window.index(n_threads);
+            const uint64_t window_begin = block_count;
+            block_count += window.size();
+
+            // make room for the window's blocks, no one else is looking at these now
+            _block_graphs->resize(block_count);
+            block_node_counts.resize(block_count, 0);
+            if (add_consensus) {
+                consensus_mapping.resize(block_count);
+            }
+#ifdef POA_DEBUG
+            block2stats.resize(block_count);
+#endif
+
+            const std::vector<uint64_t> poa_order = _blocks_by_poa_cost(&window, n_threads);
+#pragma omp parallel for schedule(dynamic,1) num_threads(n_poa_threads)
+            for (uint64_t i = 0; i < poa_order.size(); ++i) {
+                smooth_block(window_begin + poa_order[i], window.get_block(poa_order[i]));
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(mafs_ready_mutex);
+            poa_done = true;
+        }
+        mafs_ready_cv.notify_one();
+        std::cerr << smoothxg_iter << "::smooth_and_lace] applied "
+                  << (use_abpoa ? "abPOA" : "SPOA") << " to " << block_count << " blocks" << std::endl;
 
         write_maf_thread.join();
     }
@@ -2358,87 +2637,22 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
 #endif
 
     // Flip graphs
-    if (num_flipped_graphs > 0){
+    if (!blocks_to_flip.empty()){
         std::stringstream flip_graphs_banner;
-        flip_graphs_banner << smoothxg_iter << "::smooth_and_lace] flipping " << num_flipped_graphs << " block graphs:";
-        progress_meter::ProgressMeter flip_graphs_progress(block_count, flip_graphs_banner.str());
+        flip_graphs_banner << smoothxg_iter << "::smooth_and_lace] flipping " << blocks_to_flip.size() << " block graphs:";
+        progress_meter::ProgressMeter flip_graphs_progress(blocks_to_flip.size(), flip_graphs_banner.str());
 
 #pragma omp parallel for schedule(dynamic,1)
-        for (uint64_t block_id = 0; block_id < block_count; ++block_id) {
-            if (blok_to_flip.test(block_id)) {
-                auto* flipped_graph = new odgi::graph_t();
-
-                ska::flat_hash_map<handle_t, handle_t> forward_translation;
-
-                auto block_graph = get_block_graph(block_id);
-
-                // make the flipped nodes
-                block_graph->for_each_handle(
-                        [&](const handle_t& old_handle) {
-                            handle_t rev_handle = flipped_graph->create_handle(
-                                    block_graph->get_sequence(block_graph->flip(old_handle)),
-                                    block_graph->get_id(old_handle));
-                            forward_translation[old_handle] = rev_handle;
-                        });
-
-                // make the flipped edges
-                block_graph->for_each_edge([&](const edge_t& edge) {
-                    // get the two sides in the correct orientation
-                    handle_t rev_left, rev_right;
-                    if (block_graph->get_is_reverse(edge.first)) {
-                        rev_left = flipped_graph->flip(forward_translation[block_graph->flip(edge.first)]);
-                    }
-                    else {
-                        rev_left = flipped_graph->flip(forward_translation[edge.first]);
-                    }
-
-                    if (!block_graph->get_is_reverse(edge.second)) {
-                        rev_right = flipped_graph->flip(forward_translation[block_graph->flip(edge.second)]);
-                    }
-                    else {
-                        rev_right = flipped_graph->flip(forward_translation[edge.second]);
-                    }
-
-                    // actually make the edge
-                    flipped_graph->create_edge(rev_left, rev_right);
-                });
-
-                std::string consensus_name;
-                if (add_consensus){
-                    consensus_name = consensus_base_name + std::to_string(block_id);
-                }
-
-                block_graph->for_each_path_handle(
-                        [&](const path_handle_t& old_path) {
-                            string path_name = block_graph->get_path_name(old_path);
-                            path_handle_t new_path = flipped_graph->create_path_handle(path_name);
-                            if (path_name != consensus_name) {
-                                // flip the path, but preserving its sequence
-                                block_graph->for_each_step_in_path(old_path, [&](const step_handle_t& step) {
-                                    handle_t old_handle = block_graph->get_handle_of_step(step);
-                                    handle_t new_handle = flipped_graph->get_handle(
-                                            block_graph->get_id(old_handle),
-                                            !block_graph->get_is_reverse(old_handle));
-                                    flipped_graph->append_step(new_path, new_handle);
-                                });
-                            } else {
-                                // the consensus has to be encoded in reverse complement, but it remains in the forward strand
-                                block_graph->for_each_step_in_path(old_path, [&](const step_handle_t& step) {
-                                    handle_t old_handle = block_graph->get_handle_of_step(step);
-                                    handle_t new_handle = flipped_graph->get_handle(
-                                            block_graph->get_id(old_handle),
-                                            block_graph->get_is_reverse(old_handle));
-                                    flipped_graph->prepend_step(new_path, new_handle);
-                                });
-                            }
-
-                        });
+        for (uint64_t i = 0; i < blocks_to_flip.size(); ++i) {
+            const uint64_t block_id = blocks_to_flip[i];
+            std::string consensus_name;
+            if (add_consensus){
+                consensus_name = consensus_base_name + std::to_string(block_id);
+            }
 
-                save_block_graph(block_id, flipped_graph);
-                delete flipped_graph;
+            save_block_graph(block_id, get_block_graph(block_id).flip(consensus_name));
 
-                flip_graphs_progress.increment(1);
-            }
+            flip_graphs_progress.increment(1);
         }
         flip_graphs_progress.finish();
     } else {
@@ -2463,80 +2677,124 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
     // build the sequence and edges into the output graph
     auto* smoothed = new odgi::graph_t();
     std::vector<path_handle_t> paths; // for parallel iteration
+    // the steps of a path within one of its fragments follow edges of the block graph, which
+    // are already in the smoothed graph, so only the steps across fragments can lack an edge
+    std::vector<std::vector<edge_t>> fragment_junctions;
+    auto edge_less = [](const edge_t &a, const edge_t &b) {
+        return as_integer(a.first) < as_integer(b.first)
+            || (as_integer(a.first) == as_integer(b.first) && as_integer(a.second) < as_integer(b.second));
+    };
 
     // add the nodes and edges to the graph
     {
-        std::vector<uint64_t> id_mapping;
-
-        std::stringstream load_graphs_banner;
-        load_graphs_banner << smoothxg_iter << "::smooth_and_lace] loading " << block_count << " graph blocks:";
-        progress_meter::ProgressMeter load_graphs_progress(block_count, load_graphs_banner.str());
-        std::vector<std::unique_ptr<odgi::graph_t>> graphs(block_count);
-#pragma omp parallel for schedule(dynamic,1)
-        for (uint64_t idx = 0; idx < block_count; ++idx) {
-            std::string data;
-            zstdutil::DecompressString(*block_graphs[idx], data);
-            stringstream ss;
-            ss << data;
-            ss.seekg(0,std::ios_base::beg);
-            graphs[idx] = std::make_unique<odgi::graph_t>();
-            graphs[idx]->deserialize_members(ss);
-            delete block_graphs[idx];
-            load_graphs_progress.increment(1);
-        }
-        load_graphs_progress.finish();
-        _block_graphs.reset(nullptr); // we've decompressed these, now clear our block graphs
+        // the node ids of each block follow those of the previous blocks
+        std::vector<uint64_t> id_mapping(block_count, 0);
+        for (uint64_t idx = 1; idx < block_count; ++idx) {
+            id_mapping[idx] = id_mapping[idx - 1] + block_node_counts[idx - 1];
+        }
+        std::vector<block_steps_t> block_steps(block_count);
 
         std::stringstream add_graph_banner;
-        add_graph_banner << smoothxg_iter << "::smooth_and_lace] adding nodes from " << block_count << " graphs:";
+        add_graph_banner << smoothxg_iter << "::smooth_and_lace] adding nodes and edges from " << block_count << " graphs:";
         progress_meter::ProgressMeter add_graph_progress(block_count, add_graph_banner.str());
 
-        for (uint64_t idx = 0; idx < block_count; ++idx) {
-            uint64_t id_trans = smoothed->get_node_count();
-            // record the id translation
-            auto& block = graphs[idx];
-            id_mapping.push_back(id_trans);
-            if (block->get_node_count() == 0) {
-                continue;
+        // the workers decompress the blocks, keep their path steps and lay out their nodes and edges
+        // in the ids of the smoothed graph, while a single thread adds those to the smoothed graph in
+        // block order, as odgi can't take them concurrently; the workers stay within a window of
+        // blocks ahead of it, so that only a window of blocks is ever waiting
+        const uint64_t window_size = 4 * (uint64_t)std::max(n_threads, 1);
+        std::mutex ready_graphs_mutex;
+        std::condition_variable ready_graphs_cv;
+        std::condition_variable window_cv;
+        ska::flat_hash_map<uint64_t, block_nodes_t> ready_graphs;
+        uint64_t next_to_add = 0;
+
+        auto add_ready_graphs_lambda = [&]() {
+            for (uint64_t idx = 0; idx < block_count; ++idx) {
+                block_nodes_t block_nodes;
+                {
+                    std::unique_lock<std::mutex> lock(ready_graphs_mutex);
+                    ready_graphs_cv.wait(lock, [&]() { return ready_graphs.count(idx) > 0; });
+                    auto f = ready_graphs.find(idx);
+                    block_nodes = std::move(f->second);
+                    ready_graphs.erase(f);
+                }
+                assert(smoothed->get_node_count() == id_mapping[idx]);
+                block_nodes.add_to(*smoothed);
+                {
+                    std::lock_guard<std::mutex> guard(ready_graphs_mutex);
+                    next_to_add = idx + 1;
+                }
+                window_cv.notify_all();
+                add_graph_progress.increment(1);
             }
-            block->for_each_handle([&](const handle_t &h) {
-                smoothed->create_handle(block->get_sequence(h));
-            });
-            add_graph_progress.increment(1);
-        }
-        add_graph_progress.finish();
+        };
+        std::thread add_ready_graphs_thread(add_ready_graphs_lambda);
 
-        std::stringstream add_edges_banner;
-        add_edges_banner << smoothxg_iter << "::smooth_and_lace] adding edges from " << block_count << " graphs:";
-        progress_meter::ProgressMeter add_edges_progress(block_count, add_edges_banner.str());
-        for (uint64_t idx = 0; idx < block_count; ++idx) {
-            auto& id_trans = id_mapping[idx];
-            auto& block = graphs[idx];
-            block->for_each_edge([&](const edge_t &e) {
-                smoothed->create_edge(
-                        smoothed->get_handle(id_trans + block->get_id(e.first)),
-                        smoothed->get_handle(id_trans + block->get_id(e.second)));
-            });
-            add_edges_progress.increment(1);
+        std::atomic<uint64_t> next_to_load(0);
+#pragma omp parallel num_threads(n_threads)
+        {
+            uint64_t idx;
+            while ((idx = next_to_load.fetch_add(1)) < block_count) {
+                {
+                    std::unique_lock<std::mutex> lock(ready_graphs_mutex);
+                    window_cv.wait(lock, [&]() { return idx < next_to_add + window_size; });
+                }
+                block_graph_t block = get_block_graph(idx);
+                block_graphs.release(idx);
+                block_steps[idx] = block_steps_t(block);
+                block_nodes_t block_nodes(block, id_mapping[idx]);
+                {
+                    std::lock_guard<std::mutex> guard(ready_graphs_mutex);
+                    ready_graphs[idx] = std::move(block_nodes);
+                }
+                ready_graphs_cv.notify_all();
+            }
         }
-        add_edges_progress.finish();
+        add_ready_graphs_thread.join();
+        add_graph_progress.finish();
+        _block_graphs.reset(nullptr); // we've read back all the block graphs, now clear them and their file
 
         // then for each path, ensure that it's embedded in the graph by walking through
         // its block segments in order and linking them up in the output graph
+        // the fragments are sorted by path, so we first find the run of fragments of each path
+        // and create the paths in order, then embed the runs in parallel, one path per thread
+        std::vector<std::pair<uint64_t, uint64_t>> path_runs;
+        std::vector<path_handle_t> path_run_handles;
+        {
+            uint64_t run_begin = 0;
+            path_handle_t run_path;
+            for (uint64_t i = 0; i < path_mapping.size(); ++i) {
+                const path_handle_t base_path = get_base_path(path_mapping.read_value(i));
+                if (i == 0 || base_path != run_path) {
+                    if (i > 0) {
+                        path_runs.push_back({run_begin, i});
+                    }
+                    run_begin = i;
+                    run_path = base_path;
+                    path_run_handles.push_back(smoothed->create_path_handle(graph.get_path_name(base_path)));
+                }
+            }
+            if (path_mapping.size() > 0) {
+                path_runs.push_back({run_begin, path_mapping.size()});
+            }
+        }
+
         std::stringstream lace_banner;
         lace_banner << smoothxg_iter << "::smooth_and_lace] embedding " << path_mapping.size() << " path fragments:";
         progress_meter::ProgressMeter lace_progress(path_mapping.size(), lace_banner.str());
-        for (uint64_t i = 0; i < path_mapping.size(); ++i) {
-            path_position_range_t pos_range = path_mapping.read_value(i);
-            step_handle_t last_step = {0, 0};
-            bool first = true;
+        fragment_junctions.resize(path_runs.size());
+#pragma omp parallel for schedule(dynamic,1)
+        for (uint64_t r = 0; r < path_runs.size(); ++r) {
+            const path_handle_t smoothed_path = path_run_handles[r];
+            auto& junctions = fragment_junctions[r];
+            handle_t last;
+            bool has_last = false;
             uint64_t last_end_pos = 0;
-            // add the path to the graph
-
-            path_handle_t smoothed_path = smoothed->create_path_handle(
-                graph.get_path_name(get_base_path(pos_range)));
+            path_position_range_t pos_range;
             // walk the path from start to end
-            while (true) {
+            for (uint64_t i = path_runs[r].first; i < path_runs[r].second; ++i) {
+                pos_range = path_mapping.read_value(i);
                 // if we find a segment that's not included in any block, we'll add
                 // it to the final graph and link it in to do so, we detect a gap in
                 // length, collect the sequence in the gap and add it to the graph
@@ -2546,32 +2804,25 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                 }
                 // write the path steps into the graph using the id translation
                 auto block_id = get_block_id(pos_range);
-                auto& block = graphs[block_id];
+                auto& block = block_steps[block_id];
                 auto id_trans = id_mapping.at(block_id);
-                block->for_each_step_in_path(
-                    get_target_path(pos_range), [&](const step_handle_t &step) {
-                        handle_t h = block->get_handle_of_step(step);
-                        handle_t t = smoothed->get_handle(block->get_id(h) + id_trans,
-                                                          block->get_is_reverse(h));
+                bool first = true;
+                block.for_each_step_in_path(
+                    get_target_path(pos_range), [&](const handle_t &h) {
+                        handle_t t = smoothed->get_handle(block_graph_t::get_id(h) + id_trans,
+                                                          block_graph_t::get_is_reverse(h));
                         smoothed->append_step(smoothed_path, t);
                         if (first) {
                             first = false;
-                            // create edge between last and curr
-                            if (as_integers(last_step)[0] != 0) {
-                                smoothed->create_edge(
-                                    smoothed->get_handle_of_step(last_step), t);
+                            // remember the edge between the last fragment and this one
+                            if (has_last) {
+                                junctions.push_back(smoothed->edge_handle(last, t));
                             }
                         }
+                        last = t;
+                        has_last = true;
                     });
-                last_step = smoothed->path_back(smoothed_path);
                 last_end_pos = get_end_pos(pos_range);
-                if (i + 1 == path_mapping.size() ||
-                    get_base_path(path_mapping.read_value(i + 1)) != get_base_path(pos_range)) {
-                    break;
-                } else {
-                    ++i;
-                    pos_range = path_mapping.read_value(i);
-                }
                 lace_progress.increment(1);
             }
             // now add in any final sequence in the path
@@ -2602,23 +2853,17 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
             for (uint64_t i = 0; i < paths.size(); ++i) {
                 auto path = paths[i];
 
-                std::string orig_seq, smoothed_seq;
-                graph.for_each_step_in_path(
-                    graph.get_path_handle(smoothed->get_path_name(path)),
-                    [&](const step_handle_t &step) {
-                        orig_seq.append(graph.get_sequence(graph.get_handle_of_step(step)));
-                    });
-                smoothed->for_each_step_in_path(
-                    path,
-                    [&](const step_handle_t &step) {
-                        smoothed_seq.append(smoothed->get_sequence(smoothed->get_handle_of_step(step)));
-                    });
-                if (orig_seq != smoothed_seq) {
+                std::string orig_context, smoothed_context;
+                const uint64_t mismatch = _first_path_mismatch(
+                    graph, graph.get_path_handle(smoothed->get_path_name(path)),
+                    *smoothed, path,
+                    orig_context, smoothed_context);
+                if (mismatch != std::numeric_limits<uint64_t>::max()) {
                     std::cerr << smoothxg_iter << "] error! path "
                               << smoothed->get_path_name(path)
-                              << " was corrupted in the smoothed graph" << std::endl
-                              << "original\t" << orig_seq << std::endl
-                              << "smoothed\t" << smoothed_seq << std::endl;
+                              << " was corrupted in the smoothed graph, starting at offset " << mismatch << std::endl
+                              << "original\t" << orig_context << std::endl
+                              << "smoothed\t" << smoothed_context << std::endl;
                     exit(1);
                 }
 
@@ -2627,6 +2872,40 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
             validate_progress.finish();
         }
 
+#ifndef NDEBUG
+        // the steps within a fragment are expected to follow edges that came with the block graphs,
+        // as walking the edges below only adds those between fragments, so check that in debug builds
+        {
+            std::cerr << smoothxg_iter << "::smooth_and_lace] checking the edges within path fragments" << std::endl;
+#pragma omp parallel for schedule(dynamic,1)
+            for (uint64_t r = 0; r < path_runs.size(); ++r) {
+                std::vector<edge_t> junctions = fragment_junctions[r];
+                std::sort(junctions.begin(), junctions.end(), edge_less);
+                handle_t last;
+                bool has_last = false;
+                uint64_t rank = 0;
+                smoothed->for_each_step_in_path(path_run_handles[r], [&](const step_handle_t &step) {
+                    const handle_t h = smoothed->get_handle_of_step(step);
+                    if (has_last && !smoothed->has_edge(last, h)
+                        && !std::binary_search(junctions.begin(), junctions.end(), smoothed->edge_handle(last, h), edge_less)) {
+                        std::cerr << smoothxg_iter << "] error! path "
+                                  << smoothed->get_path_name(path_run_handles[r])
+                                  << " steps from node " << smoothed->get_id(last)
+                                  << (smoothed->get_is_reverse(last) ? "-" : "+")
+                                  << " to node " << smoothed->get_id(h)
+                                  << (smoothed->get_is_reverse(h) ? "-" : "+")
+                                  << " at step " << rank
+                                  << " inside a fragment, but the block graph has no such edge" << std::endl;
+                        exit(1);
+                    }
+                    last = h;
+                    has_last = true;
+                    ++rank;
+                });
+            }
+        }
+#endif
+
         if (!consensus_mapping.empty()) {
             std::cerr << smoothxg_iter << "::smooth_and_lace] sorting consensus" << std::endl;
 
@@ -2666,9 +2945,8 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
             for (uint64_t id = 0; id < consensus_mapping.size(); ++id) {
                 //for (auto &pos_range : consensus_mapping) {
                 if (!exclude_unmerged_consensus.test(id)) {
-                    auto& block = graphs[id];
                     consensus_paths[id] = smoothed->create_path_handle(
-                            block->get_path_name(consensus_mapping[id]));
+                            consensus_base_name + std::to_string(id));
                 } // else skip the embedding of the single consensus sequences
             }
 
@@ -2680,12 +2958,11 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                 if (exclude_unmerged_consensus.test(id)) {
                     continue; // skip the embedding for the single consensus sequence
                 }
-                auto& block = graphs[id];
+                auto& block = block_steps[id];
                 path_handle_t smoothed_path = consensus_paths[id];
                 auto &id_trans = id_mapping[id];
-                block->for_each_step_in_path(consensus_mapping[id], [&](const step_handle_t &step) {
-                        handle_t h = block->get_handle_of_step(step);
-                        handle_t t = smoothed->get_handle(block->get_id(h) + id_trans, block->get_is_reverse(h));
+                block.for_each_step_in_path(consensus_mapping[id], [&](const handle_t &h) {
+                        handle_t t = smoothed->get_handle(block_graph_t::get_id(h) + id_trans, block_graph_t::get_is_reverse(h));
                         smoothed->append_step(smoothed_path, t);
                         // nb: by definition of our construction of smoothed
                         // the consensus paths should have all their edges embedded
@@ -2709,6 +2986,7 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                 std::cerr << smoothxg_iter << "::smooth_and_lace] embedding merged consensus: creating step handles" << std::endl;
                 std::mutex consensus_path_is_merged_mutex;
                 ska::flat_hash_set<uint64_t> consensus_path_is_merged;
+                std::vector<std::vector<edge_t>> merged_consensus_junctions(merged_block_id_intervals_tree_vector.size());
                 assert(merged_block_id_intervals_tree_vector.size() == block_id_ranges_vector.size());
 
 #pragma omp parallel for schedule(dynamic,1)
@@ -2717,6 +2995,9 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
 
                     bool inverted_intervals = inverted_merged_block_id_intervals_ranks.count(i) != 0;
                     path_handle_t consensus_path = merged_consensus_paths[i];
+                    auto& junctions = merged_consensus_junctions[i];
+                    handle_t last;
+                    bool has_last = false;
 
                     std::vector<size_t> merged_block_id_intervals;
                     merged_block_id_intervals_tree.overlap(0, block_count, merged_block_id_intervals);
@@ -2756,14 +3037,23 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                 consensus_path_is_merged.insert(as_integer(consensus_paths[block_id]));
                             }
 
-                            auto& block = graphs[block_id];
+                            auto& block = block_steps[block_id];
                             auto& id_trans = id_mapping[block_id];
-                            block->for_each_step_in_path(
+                            bool first = true;
+                            block.for_each_step_in_path(
                                 consensus_mapping[block_id],
-                                [&](const step_handle_t &step) {
-                                    handle_t h = block->get_handle_of_step(step);
-                                    handle_t t = smoothed->get_handle(block->get_id(h) + id_trans, block->get_is_reverse(h));
+                                [&](const handle_t &h) {
+                                    handle_t t = smoothed->get_handle(block_graph_t::get_id(h) + id_trans, block_graph_t::get_is_reverse(h));
                                     smoothed->append_step(consensus_path, t);
+                                    if (first) {
+                                        first = false;
+                                        // the merged consensus jumps from one block to the next
+                                        if (has_last) {
+                                            junctions.push_back(smoothed->edge_handle(last, t));
+                                        }
+                                    }
+                                    last = t;
+                                    has_last = true;
                                 });
                         }
                     }
@@ -2771,6 +3061,10 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                     clear_string(block_id_ranges_vector[i]);
                 }
 
+                for (auto& junctions : merged_consensus_junctions) {
+                    fragment_junctions.push_back(std::move(junctions));
+                }
+
                 // now for each consensus path that's not been merged, and for each merged consensus path...
                 // record our path handles for later use in consensus graph generation
 
@@ -2805,25 +3099,33 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
     {
         std::stringstream embed_banner;
         embed_banner << smoothxg_iter << "::smooth_and_lace] walking edges in "
-                     << paths.size() << " paths:";
-        progress_meter::ProgressMeter embed_progress(paths.size(), embed_banner.str());
-        // embed all paths in the graph to ensure validity
-        smoothed->for_each_path_handle(
-            [&](const path_handle_t& path) {
-                handle_t last;
-                step_handle_t begin_step = smoothed->path_begin(path);
-                smoothed->for_each_step_in_path(
-                    path,
-                    [&](const step_handle_t &step) {
-                        handle_t h = smoothed->get_handle_of_step(step);
-                        if (step != begin_step) {
-                            smoothed->create_edge(last, h);
-                        }
-                        last = h;
-                    });
-                embed_progress.increment(1);
-            });
+                     << fragment_junctions.size() << " paths:";
+        progress_meter::ProgressMeter embed_progress(fragment_junctions.size(), embed_banner.str());
+        // collect the unique edges of each path, then of all of them, and add them in one go
+#pragma omp parallel for schedule(dynamic,1)
+        for (uint64_t i = 0; i < fragment_junctions.size(); ++i) {
+            auto& junctions = fragment_junctions[i];
+            std::sort(junctions.begin(), junctions.end(), edge_less);
+            junctions.erase(std::unique(junctions.begin(), junctions.end()), junctions.end());
+            embed_progress.increment(1);
+        }
         embed_progress.finish();
+
+        std::vector<edge_t> edges;
+        uint64_t edge_count = 0;
+        for (auto& junctions : fragment_junctions) {
+            edge_count += junctions.size();
+        }
+        edges.reserve(edge_count);
+        for (auto& junctions : fragment_junctions) {
+            edges.insert(edges.end(), junctions.begin(), junctions.end());
+            std::vector<edge_t>().swap(junctions);
+        }
+        ips4o::parallel::sort(edges.begin(), edges.end(), edge_less);
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+        for (auto& edge : edges) {
+            smoothed->create_edge(edge.first, edge.second);
+        }
     }
 
     return smoothed;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "blocks.hpp"
+#include "block_graph.hpp"
 #include "deps/abPOA/include/abpoa.h"
 #include "deps/abPOA/src/kdq.h"
 #include "deps/abPOA/src/utils.h"
@@ -21,8 +22,11 @@
 #include <cmath>
 #include <iostream>
 #include <mutex>
+#include <condition_variable>
 #include <sstream>
 #include <vector>
+#include <limits>
+#include <tuple>
 #include <cstring>
 
 #include "deps/abPOA/src/abpoa_graph.h"
@@ -39,6 +43,8 @@
 
 namespace smoothxg {
 
+const uint64_t DEFAULT_BLOCK_GRAPH_DICT_SAMPLES = 1000;
+
 using path_position_range_t = std::tuple<path_handle_t, uint64_t, uint64_t, path_handle_t, uint64_t>;
 
 inline auto& get_base_path(const path_position_range_t& p) {
@@ -61,6 +67,95 @@ inline auto& get_block_id(const path_position_range_t& p) {
     return std::get<4>(p);
 }
 
+// lets POA jobs run while their estimated footprints fit in a memory budget;
+// a job is always admitted when nothing else is running, however large it is
+class poa_memory_gate_t {
+public:
+    explicit poa_memory_gate_t(const uint64_t& max_memory) : _max_memory(max_memory) {}
+
+    void acquire(const uint64_t& bytes) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _admitted.wait(lock, [&]() { return _in_use == 0 || _in_use + bytes <= _max_memory; });
+        _in_use += bytes;
+    }
+
+    void release(const uint64_t& bytes) {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _in_use -= bytes;
+        }
+        _admitted.notify_all();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _admitted;
+    const uint64_t _max_memory;
+    uint64_t _in_use = 0;
+};
+
+// SPOA state a POA thread keeps between blocks: one alignment engine, which holds
+// on to its DP matrices; the graph is built per block, as spoa::Graph::Clear() frees its storage anyway
+class spoa_context_t {
+public:
+    // get the engine for this alignment type and scoring, grown to fit max_sequence_size;
+    // an engine set up for another scoring is dropped first
+    spoa::AlignmentEngine* get_engine(const bool& local_alignment,
+                                      std::int8_t poa_m, std::int8_t poa_n, std::int8_t poa_g,
+                                      std::int8_t poa_e, std::int8_t poa_q, std::int8_t poa_c,
+                                      const uint64_t& max_sequence_size);
+
+    // keep the engine for the next block only while its matrices fit in max_retained_memory
+    void set_max_retained_memory(const uint64_t& max_retained_memory);
+
+    // drop the engine if it grew past the retained memory limit, having last aligned against graph_nodes nodes
+    void trim(const uint64_t& graph_nodes);
+
+private:
+    std::unique_ptr<spoa::AlignmentEngine> _engine;
+    std::tuple<bool, std::int8_t, std::int8_t, std::int8_t, std::int8_t, std::int8_t, std::int8_t> _engine_key;
+    uint64_t _max_sequence_size = 0;
+    uint64_t _max_retained_memory = std::numeric_limits<uint64_t>::max();
+};
+
+// abPOA state a POA thread keeps between blocks: the aligner with its DP buffers,
+// reset for every block, and the parameters, rebuilt only when the setup changes
+class abpoa_context_t {
+public:
+    abpoa_context_t() = default;
+    abpoa_context_t(const abpoa_context_t& other) = delete;
+    abpoa_context_t& operator=(const abpoa_context_t& other) = delete;
+    ~abpoa_context_t();
+
+    abpoa_para_t* get_para(const bool& local_alignment, const bool& banded_alignment,
+                           const bool& add_consensus, const bool& generate_msa,
+                           int poa_m, int poa_n, int poa_g,
+                           int poa_e, int poa_q, int poa_c);
+
+    // get the aligner, allocated again if trim() freed it
+    abpoa_t* get_abpoa(void);
+
+    // keep the aligner for the next block only while its buffers fit in max_retained_memory
+    void set_max_retained_memory(const uint64_t& max_retained_memory);
+
+    // free the aligner if the last block's estimated footprint was past the retained memory limit
+    void trim(const uint64_t& last_block_memory);
+
+private:
+    abpoa_t* _ab = nullptr;
+    abpoa_para_t* _abpt = nullptr;
+    std::tuple<bool, bool, bool, bool, int, int, int, int, int, int> _para_key;
+    uint64_t _max_retained_memory = std::numeric_limits<uint64_t>::max();
+};
+
+// rough abPOA footprint from the unique sequence count and the longest sequence,
+// dominated by the DP matrices (graph nodes x sequence length, fewer columns when banded)
+uint64_t estimate_abpoa_memory(const uint64_t& n_seqs, const uint64_t& max_sequence_size, const bool& banded_alignment);
+
+// rough SPOA footprint; the engine preallocates DP rows for four graph nodes per base
+// of the longest sequence, so this is never below that however few sequences there are
+uint64_t estimate_spoa_memory(const uint64_t& n_seqs, const uint64_t& max_sequence_size);
+
 void write_fasta_for_block(const xg::XG &graph,
                          const block_t &block,
                          const uint64_t &block_id,
@@ -98,8 +193,11 @@ odgi::graph_t* smooth_spoa(const xg::XG &graph, const block_t &block, uint64_t b
 #endif
                            const std::string &consensus_name = "");
 
+// smooth the blocks handed out by next_block, in block id order, until it returns false,
+// and lace the results into a new graph; blocks waiting for POA are held in a blockset of max_blockset_memory
 odgi::graph_t* smooth_and_lace(const xg::XG &graph,
-                               blockset_t*& blockset,
+                               const std::function<bool(block_t&)>& next_block,
+                               uint64_t max_blockset_memory,
                                int poa_m, int poa_n,
                                int poa_g, int poa_e,
                                int poa_q, int poa_c,
@@ -110,6 +208,9 @@ odgi::graph_t* smooth_and_lace(const xg::XG &graph,
                                bool local_alignment,
                                int n_threads,
                                int n_poa_threads,
+                               uint64_t max_poa_memory,
+                               uint64_t block_graph_dict_samples,
+                               uint64_t max_block_graph_memory,
                                const std::string &path_output_maf, std::string &maf_header,
                                bool merge_blocks, bool preserve_unmerged_consensus, double contiguous_path_jaccard,
                                bool use_abpoa,
@@ -4,12 +4,16 @@
 #include "mmmultimap.hpp"
 
 #include <bitset>
+#include <cstring>
 #include <arpa/inet.h>
 #include <mutex>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <handlegraph/util.hpp>
 
-#include "gfakluge.hpp"
+#include "gfa_reader.hpp"
 
 #include "tempfile.hpp"
 
@@ -692,41 +696,27 @@ void XG::dump_to_stream(std::ostream& out) const {
     out << "===END XG===" << std::endl;
 }
 
-void XG::from_gfa(const std::string& gfa_filename, bool validate, std::string basename) {
-    char* filename = (char*)gfa_filename.c_str();
-    gfak::GFAKluge gfa;
+void XG::from_gfa(const std::string& gfa_filename, bool validate, std::string basename, uint64_t num_threads) {
+    if (num_threads == 0) {
+        num_threads = get_thread_count();
+    }
+    // parse the memory-mapped GFA once, in parallel, and replay its records in file order
+    GFAReader gfa(gfa_filename, num_threads);
     // set up our enumerators
     auto for_each_sequence = [&](const std::function<void(const std::string& seq, const nid_t& node_id)>& lambda) {
-        gfa.for_each_sequence_line_in_file(filename, [&](const gfak::sequence_elem& s) {
-            nid_t node_id = std::stol(s.name);
-            lambda(s.sequence, node_id);
-        });
+        gfa.for_each_sequence(lambda);
     };
     auto for_each_edge = [&](const std::function<void(const nid_t& from_id, const bool& from_rev,
                                                       const nid_t& to_id, const bool& to_rev)>& lambda) {
-        gfa.for_each_edge_line_in_file(filename, [&](const gfak::edge_elem& e) {
-            if (e.source_name.empty()) return;
-            nid_t from_id = std::stol(e.source_name);
-            bool from_rev = !e.source_orientation_forward;
-            nid_t to_id = std::stol(e.sink_name);
-            bool to_rev = !e.sink_orientation_forward;
-            lambda(from_id, from_rev, to_id, to_rev);
-        });
+        gfa.for_each_edge(lambda);
     };
     auto for_each_path_element = [&](const std::function<void(const std::string& path_name,
                                                               const nid_t& node_id, const bool& is_rev,
                                                               const std::string& cigar,
                                                               const bool& is_empty, const bool& is_circular)>& lambda) {
-        gfa.for_each_path_element_in_file(filename, [&](const std::string& path_name_raw, const std::string& node_id_str,
-                                                        bool is_rev, const std::string& cigar,
-                                                        bool is_empty, bool is_circular) {
-            nid_t node_id = std::stol(node_id_str);
-            std::string path_name = path_name_raw;
-            path_name.erase(std::remove_if(path_name.begin(), path_name.end(), [](char c) { return std::isspace(c); }), path_name.end());
-            lambda(path_name, node_id, is_rev, cigar, is_empty, is_circular);
-        });
+        gfa.for_each_path_element(lambda);
     };
-    from_enumerators(for_each_sequence, for_each_edge, for_each_path_element, validate, basename);
+    from_enumerators(for_each_sequence, for_each_edge, for_each_path_element, validate, basename, num_threads);
 }
 
 
@@ -754,7 +744,7 @@ void XG::from_handle_graph(const HandleGraph& graph) {
 }
 
 /// build the graph from another path handle graph
-void XG::from_path_handle_graph(const PathHandleGraph& graph) {
+void XG::from_path_handle_graph(const PathHandleGraph& graph, bool validate, std::string basename, uint64_t num_threads) {
     // set up our enumerators
     auto for_each_sequence = [&](const std::function<void(const std::string& seq, const nid_t& node_id)>& lambda) {
         graph.for_each_handle([&](const handle_t& handle) {
@@ -785,7 +775,7 @@ void XG::from_path_handle_graph(const PathHandleGraph& graph) {
                 }
             });
     };
-    from_enumerators(for_each_sequence, for_each_edge, for_each_path_element, false);
+    from_enumerators(for_each_sequence, for_each_edge, for_each_path_element, validate, basename, num_threads);
 }
 
 void XG::from_enumerators(const std::function<void(const std::function<void(const std::string& seq, const nid_t& node_id)>&)>& for_each_sequence,
@@ -795,11 +785,14 @@ void XG::from_enumerators(const std::function<void(const std::function<void(cons
                                                                             const nid_t& node_id, const bool& is_rev,
                                                                             const std::string& cigar, const bool& is_empty,
                                                                             const bool& is_circular)>&)>& for_each_path_element,
-                          bool validate, std::string basename) {
+                          bool validate, std::string basename, uint64_t num_threads) {
 
     if (basename.empty()) {
         basename = temp_file::get_dir() + "/";
     }
+    if (num_threads == 0) {
+        num_threads = get_thread_count();
+    }
 
     node_count = 0;
     seq_length = 0;
@@ -942,8 +935,8 @@ void XG::from_enumerators(const std::function<void(const std::function<void(cons
         }
     });
     handle_t max_handle = number_bool_packing::pack(r_iv.size(), true);
-    edge_left_side_mm->index(get_thread_count(), as_integer(max_handle));
-    edge_right_side_mm->index(get_thread_count(), as_integer(max_handle));
+    edge_left_side_mm->index(num_threads, as_integer(max_handle));
+    edge_right_side_mm->index(num_threads, as_integer(max_handle));
 
     // calculate g_iv size (header + edges stored twice, except reversing self edges)
     size_t g_iv_size = node_count * G_NODE_HEADER_LENGTH + (edge_count * 2 - num_reversing_self_edges);
@@ -1001,6 +994,8 @@ void XG::from_enumerators(const std::function<void(const std::function<void(cons
 #endif
 
     // convert the edges in g_iv to relativistic form
+    // each node's edges are disjoint in g_iv, which is still 64-bit wide here
+#pragma omp parallel for schedule(static) num_threads(num_threads)
     for (int64_t i = 0; i < node_count; ++i) {
         int64_t id = i_iv[i];
         // find the start of the node's record in g_iv
@@ -1030,6 +1025,31 @@ void XG::from_enumerators(const std::function<void(const std::function<void(cons
     bool curr_is_circular = false; // TODO, use TP:Z:circular tag... we'll have to fish this out of the file
     uint64_t p = 0;
 
+    // accumulated paths are built into XGPaths in parallel, in batches bounded by their total step count
+    struct pending_path_t {
+        std::string name;
+        std::vector<handle_t> steps;
+        bool is_circular;
+    };
+    std::vector<pending_path_t> pending_paths;
+    uint64_t pending_step_count = 0;
+    const uint64_t max_pending_step_count = 1 << 27;
+
+    auto build_pending_paths = [&](void) {
+        uint64_t first = paths.size();
+        paths.resize(first + pending_paths.size());
+#pragma omp parallel for schedule(dynamic,1) num_threads(num_threads)
+        for (uint64_t i = 0; i < pending_paths.size(); ++i) {
+            auto& pending = pending_paths[i];
+            paths[first + i] = new XGPath(pending.name, pending.steps,
+                                          pending.is_circular,
+                                          *this);
+            std::vector<handle_t>().swap(pending.steps);
+        }
+        pending_paths.clear();
+        pending_step_count = 0;
+    };
+
     auto build_accumulated_path = [&](void) {
         // only build if we had a path to build
 #ifdef VERBOSE_DEBUG
@@ -1055,14 +1075,12 @@ void XG::from_enumerators(const std::function<void(const std::function<void(cons
             std::cerr << curr_path_name << std::endl;
         }
         path_names += path_name_csa_delim + curr_path_name;
-        XGPath* path = new XGPath(curr_path_name, curr_path_steps,
-                                  curr_is_circular,
-                                  *this);
-        paths.push_back(path);
-        
-#ifdef debug_path_index
-        std::cerr << "paths[" << paths.size() - 1 << "] = " << curr_path_name << " @ " << path << std::endl;
-#endif
+        pending_step_count += curr_path_steps.size();
+        pending_paths.push_back({curr_path_name, std::move(curr_path_steps), curr_is_circular});
+        curr_path_steps = std::vector<handle_t>();
+        if (pending_step_count >= max_pending_step_count || pending_paths.size() >= 64 * num_threads) {
+            build_pending_paths();
+        }
     };
 
     // todo ... is it circular?
@@ -1092,6 +1110,7 @@ void XG::from_enumerators(const std::function<void(const std::function<void(cons
     if (has_path) {
         build_accumulated_path();
     }
+    build_pending_paths();
     path_names += path_name_csa_delim; // final delimiter for search symmetry
     curr_path_steps.clear();
     curr_is_circular = false;
@@ -1133,7 +1152,7 @@ void XG::from_enumerators(const std::function<void(const std::function<void(cons
 #endif
     
     // create the node-to-path indexes
-    index_node_to_path(basename);
+    index_node_to_path(basename, num_threads);
 
     // validate the graph
     if (validate) {
@@ -1405,20 +1424,35 @@ uint64_t XG::encode_edge(const size_t& offest_from, const size_t& offset_to,
     return edge;
 }
 
-void XG::index_node_to_path(const std::string& basename) {
+void XG::index_node_to_path(const std::string& basename, uint64_t num_threads) {
+    if (num_threads == 0) {
+        num_threads = get_thread_count();
+    }
     
     // node -> paths
     // use the mmmultimap...
     std::string node_path_idx = basename + ".node_path.mm";
     auto node_path_mm = std::make_unique<mmmulti::map<uint64_t, std::tuple<uint64_t, uint64_t, uint64_t>>>(node_path_idx, std::make_tuple(0,0,0));
     node_path_mm->open_writer();
-    uint64_t path_step_count = 0;
+    // paths are walked in parallel, each thread buffering its entries and appending them in bulk
+    // the index sorts the entries, so the order in which they're appended doesn't matter
+    std::mutex node_path_mm_mutex;
+    const uint64_t node_path_buffer_size = 1 << 20;
     // for each path...
-    // could be done in parallel
+#pragma omp parallel for schedule(dynamic,1) num_threads(num_threads)
     for (size_t i = 1; i <= paths.size(); ++i) {
         // Go through paths by number, so we can determine rank
         path_handle_t path_handle = as_path_handle(i);
         const XGPath& path = *paths[i-1];
+        std::vector<std::pair<uint64_t, std::tuple<uint64_t, uint64_t, uint64_t>>> buffer;
+        buffer.reserve(std::min(node_path_buffer_size, (uint64_t)path.handles.size()));
+        auto flush_buffer = [&](void) {
+            std::lock_guard<std::mutex> guard(node_path_mm_mutex);
+            for (auto& entry : buffer) {
+                node_path_mm->append(entry.first, entry.second);
+            }
+            buffer.clear();
+        };
 #ifdef debug_path_index
         std::cerr << "Indexing path " << &path << " at index " << i-1 << " of " << paths.size() << std::endl; 
 #endif
@@ -1443,16 +1477,19 @@ void XG::index_node_to_path(const std::string& basename) {
             uint64_t path_and_rev = as_integer(number_bool_packing::pack(as_integer(path_handle), is_rev));
             // determine the path relative position on the forward strand
             uint64_t adj_pos = is_rev ? pos + handle_length - 1: pos;
-            node_path_mm->append(id_to_rank(get_id(handle)),
+            buffer.emplace_back(id_to_rank(get_id(handle)),
                                 std::make_tuple(path_and_rev, j, adj_pos));
-            ++path_step_count;
+            if (buffer.size() == node_path_buffer_size) {
+                flush_buffer();
+            }
             pos += handle_length;
         }
+        flush_buffer();
     }
 #ifdef VERBOSE_DEBUG
     std::cerr << path_count << " of " << path_count << " ~ 100.0000%" << std::endl;
 #endif
-    node_path_mm->index(get_thread_count(), node_count+1);
+    node_path_mm->index(num_threads, node_count+1);
     
 #ifdef VERBOSE_DEBUG
     std::cerr << "determining size of node to path position mappings" << std::endl;
@@ -1933,26 +1970,187 @@ size_t XG::get_length(const handle_t& handle) const {
     return g_iv[handlegraph::number_bool_packing::unpack_number(handle) + G_NODE_LENGTH_OFFSET];
 }
 
+// codes as written by dna3bit, padded out for table lookups
+static const char dna3bit_fwd_table[16] = {'A', 'T', 'C', 'G', 'N', 'N', 'N', 'N',
+                                           'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N'};
+static const char dna3bit_rev_table[16] = {'T', 'A', 'G', 'C', 'N', 'N', 'N', 'N',
+                                           'N', 'N', 'N', 'N', 'N', 'N', 'N', 'N'};
+
+// Decode the bases of seq_iv in [start, start+length) into out, or their reverse
+// complement back to front when is_rev, for as many whole vectors as fit.
+// Returns how many bases were decoded; the caller finishes the rest.
+typedef size_t (*decode_sequence_kernel_t)(const sdsl::int_vector<>& seq_iv, size_t start, size_t length,
+                                           bool is_rev, char* out);
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+// spread the low 8 codes of width bits each into the low bits of 8 bytes, halving the
+// groups at each step; plain shifts, as pdep is microcoded and slow on AMD before Zen 3
+static inline uint64_t spread_codes(uint64_t bits, uint8_t width) {
+    const uint64_t four = (1ULL << (4 * width)) - 1;
+    const uint64_t two = ((1ULL << (2 * width)) - 1) * 0x0000000100000001ULL;
+    const uint64_t one = ((1ULL << width) - 1) * 0x0001000100010001ULL;
+    uint64_t x = (bits & four) | (((bits >> (4 * width)) & four) << 32);
+    x = (x & two) | (((x >> (2 * width)) & two) << 16);
+    x = (x & one) | (((x >> width) & one) << 8);
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_sequence_ssse3(const sdsl::int_vector<>& seq_iv, size_t start, size_t length,
+                                    bool is_rev, char* out) {
+    const uint8_t width = seq_iv.width();
+    const __m128i table = _mm_loadu_si128((const __m128i*)(is_rev ? dna3bit_rev_table : dna3bit_fwd_table));
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        // 16 codes are at most 48 bits
+        const uint64_t bits = seq_iv.get_int((start + i) * width, 16 * width);
+        const __m128i codes = _mm_set_epi64x(spread_codes(bits >> (8 * width), width),
+                                             spread_codes(bits, width));
+        __m128i bases = _mm_shuffle_epi8(table, codes);
+        if (is_rev) {
+            bases = _mm_shuffle_epi8(bases, reverse);
+            _mm_storeu_si128((__m128i*)(out + length - i - 16), bases);
+        } else {
+            _mm_storeu_si128((__m128i*)(out + i), bases);
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t decode_sequence_avx2(const sdsl::int_vector<>& seq_iv, size_t start, size_t length,
+                                   bool is_rev, char* out) {
+    const uint8_t width = seq_iv.width();
+    const __m256i table = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i*)(is_rev ? dna3bit_rev_table : dna3bit_fwd_table)));
+    const __m256i reverse = _mm256_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                            0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        const uint64_t lo = seq_iv.get_int((start + i) * width, 16 * width);
+        const uint64_t hi = seq_iv.get_int((start + i + 16) * width, 16 * width);
+        const __m256i codes = _mm256_set_epi64x(spread_codes(hi >> (8 * width), width),
+                                                spread_codes(hi, width),
+                                                spread_codes(lo >> (8 * width), width),
+                                                spread_codes(lo, width));
+        __m256i bases = _mm256_shuffle_epi8(table, codes);
+        if (is_rev) {
+            // reverse within each lane, then swap the lanes
+            bases = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(bases, reverse), 0x4E);
+            _mm256_storeu_si256((__m256i*)(out + length - i - 32), bases);
+        } else {
+            _mm256_storeu_si256((__m256i*)(out + i), bases);
+        }
+    }
+    return i;
+}
+
+// the vectorized kernel for this CPU, or nullptr if there is none
+static decode_sequence_kernel_t pick_decode_sequence_kernel(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return decode_sequence_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        return decode_sequence_ssse3;
+    }
+    return nullptr;
+}
+
+#else
+
+static decode_sequence_kernel_t pick_decode_sequence_kernel(void) {
+    return nullptr;
+}
+
+#endif
+
+void XG::decode_sequence(size_t start, size_t length, bool is_rev, char* out) const {
+    const uint8_t width = s_iv.width();
+    if (width > 3) {
+        // not bit-compressed, go base by base
+        for (size_t i = 0; i < length; ++i) {
+            char c = revdna3bit(s_iv[start + i]);
+            if (is_rev) {
+                out[length - i - 1] = reverse_complement(c);
+            } else {
+                out[i] = c;
+            }
+        }
+        return;
+    }
+    // the vectorized kernel for this CPU takes the bulk, whole words finish the tail,
+    // or decode everything when there is no kernel
+    static const decode_sequence_kernel_t kernel = pick_decode_sequence_kernel();
+    size_t i = (kernel != nullptr && width >= 2) ? kernel(s_iv, start, length, is_rev, out) : 0;
+    const char* table = is_rev ? dna3bit_rev_table : dna3bit_fwd_table;
+    const uint64_t mask = (1ULL << width) - 1;
+    const size_t bases_per_word = 64 / width;
+    while (i < length) {
+        const size_t n = std::min(bases_per_word, length - i);
+        uint64_t word = s_iv.get_int((start + i) * width, n * width);
+        if (is_rev) {
+            // the reverse complement is written back to front in the same pass
+            char* o = out + (length - i - 1);
+            for (size_t j = 0; j < n; ++j, word >>= width) {
+                *o-- = table[word & mask];
+            }
+        } else {
+            char* o = out + i;
+            for (size_t j = 0; j < n; ++j, word >>= width) {
+                *o++ = table[word & mask];
+            }
+        }
+        i += n;
+    }
+#ifndef NDEBUG
+    // debug builds, such as the CI test run, check the result against base-by-base decoding
+    for (size_t j = 0; j < length; ++j) {
+        char c = revdna3bit(s_iv[start + j]);
+        assert(is_rev ? out[length - j - 1] == reverse_complement(c) : out[j] == c);
+    }
+#endif
+}
+
 string XG::get_sequence(const handle_t& handle) const {
-    
-    // Figure out how big it should be
-    size_t sequence_size = get_length(handle);
-    // Allocate the sequence string
-    string sequence(sequence_size, '\0');
+    string sequence;
+    append_sequence(handle, sequence);
+    return sequence;
+}
+
+void XG::append_sequence(const handle_t& handle, std::string& seq) const {
     // Extract the node record start
     size_t g = handlegraph::number_bool_packing::unpack_number(handle);
-    // Figure out where the sequence starts
+    // Figure out how big it is and where it starts
+    size_t sequence_size = g_iv[g + G_NODE_LENGTH_OFFSET];
     size_t sequence_start = g_iv[g + G_NODE_SEQ_START_OFFSET];
-    for (int64_t i = 0; i < sequence_size; i++) {
-        // Blit the sequence out
-        sequence[i] = revdna3bit(s_iv[sequence_start + i]);
+    size_t offset = seq.size();
+    seq.resize(offset + sequence_size);
+    decode_sequence(sequence_start, sequence_size, handlegraph::number_bool_packing::unpack_bit(handle), &seq[offset]);
+}
+
+void XG::append_subsequence(const handle_t& handle, size_t index, size_t size, std::string& seq) const {
+    // Extract the node record start
+    size_t g = handlegraph::number_bool_packing::unpack_number(handle);
+    size_t sequence_size = g_iv[g + G_NODE_LENGTH_OFFSET];
+    if (index >= sequence_size) {
+        return;
     }
-    
-    if (handlegraph::number_bool_packing::unpack_bit(handle)) {
-        reverse_complement_in_place(sequence);
+    // don't go past the end of the sequence
+    size = min(size, sequence_size - index);
+    size_t sequence_start = g_iv[g + G_NODE_SEQ_START_OFFSET];
+    bool is_rev = handlegraph::number_bool_packing::unpack_bit(handle);
+    size_t offset = seq.size();
+    seq.resize(offset + size);
+    decode_sequence(is_rev ? sequence_start + sequence_size - index - size : sequence_start + index,
+                    size, is_rev, &seq[offset]);
+}
+
+void XG::append_path_range_sequence(const step_handle_t& begin, const step_handle_t& end, std::string& seq) const {
+    for (step_handle_t step = begin; step != end; step = get_next_step(step)) {
+        append_sequence(get_handle_of_step(step), seq);
     }
-    
-    return sequence;
 }
 
 char XG::get_base(const handle_t& handle, size_t index) const {
@@ -1960,37 +2158,18 @@ char XG::get_base(const handle_t& handle, size_t index) const {
     // Figure out where the sequence starts
     size_t sequence_start = g_iv[handlegraph::number_bool_packing::unpack_number(handle) + G_NODE_SEQ_START_OFFSET];
     
-    // get the character
+    // get the character, complemented in the same lookup for reverse handles
     if (get_is_reverse(handle)) {
-        return reverse_complement(revdna3bit(s_iv[sequence_start + get_length(handle) - index - 1]));
+        return dna3bit_rev_table[s_iv[sequence_start + get_length(handle) - index - 1] & 0xf];
     }
     else {
-        return revdna3bit(s_iv[sequence_start + index]);
+        return dna3bit_fwd_table[s_iv[sequence_start + index] & 0xf];
     }
 }
 
 string XG::get_subsequence(const handle_t& handle, size_t index, size_t size) const {
-    
-    // Figure out how big it should be
-    size_t sequence_size = get_length(handle);
-    // don't go past the end of the sequence
-    size = min(size, sequence_size - index);
-    // Figure out where the sequence starts
-    size_t sequence_start = g_iv[handlegraph::number_bool_packing::unpack_number(handle) + G_NODE_SEQ_START_OFFSET];
-
-    // Allocate the sequence string
-    string subsequence(size, '\0');
-    // unpack the sequence and handle orientation
-    if (get_is_reverse(handle)) {
-        for (size_t i = 0, subseq_start = sequence_start + get_length(handle) - index - size; i < size; ++i) {
-            subsequence[subsequence.size() - i - 1] = reverse_complement(revdna3bit(s_iv[subseq_start + i]));
-        }
-    }
-    else {
-        for (size_t i = 0, subseq_start = sequence_start + index; i < size; ++i) {
-            subsequence[i] = revdna3bit(s_iv[subseq_start + i]);
-        }
-    }
+    string subsequence;
+    append_subsequence(handle, index, size, subsequence);
     return subsequence;
 }
 
@@ -200,11 +200,14 @@ public:
     /// Build the graph from another path handle graph.
     /// The order in which nodes are enumerated becomes the XG's node order.
     /// Note that we will get the best efficiency if the graph enumerates itself in topological order.
-    void from_path_handle_graph(const PathHandleGraph& graph);
+    /// Temporary files for the construction go under basename, as in from_gfa.
+    void from_path_handle_graph(const PathHandleGraph& graph, bool validate = false, std::string basename = "",
+                                uint64_t num_threads = 0);
 
     /// Use external enumerators to drive graph construction.
     /// The order in which nodes are enumerated becomes the XG's node order.
     /// Note that we will get the best efficiency if the graph is enumerated in topological order.
+    /// Paths are built and the multimaps sorted with num_threads threads (0 = all OpenMP threads).
     void from_enumerators(const std::function<void(const std::function<void(const std::string& seq, const nid_t& node_id)>&)>& for_each_sequence,
                           const std::function<void(const std::function<void(const nid_t& from, const bool& from_rev,
                                                                             const nid_t& to, const bool& to_rev)>&)>& for_each_edge,
@@ -212,10 +215,11 @@ public:
                                                                             const nid_t& node_id, const bool& is_rev,
                                                                             const std::string& cigar, const bool& is_empty,
                                                                             const bool& is_circular)>&)>& for_each_path_element,
-                          bool validate = false, std::string basename = "");
+                          bool validate = false, std::string basename = "", uint64_t num_threads = 0);
 
-    /// Use a memory-mapped GFA file to build the index in low memory
-    void from_gfa(const std::string& gfa_filename, bool validate = false, std::string basename = "");
+    /// Use a memory-mapped GFA file, parsed in parallel, to build the index
+    void from_gfa(const std::string& gfa_filename, bool validate = false, std::string basename = "",
+                  uint64_t num_threads = 0);
 
     void to_gfa(std::ostream& out) const;
 
@@ -300,6 +304,15 @@ public:
     /// handle. If the indicated substring would extend beyond the end of the
     /// handle's sequence, the return value is truncated to the sequence's end.
     virtual std::string get_subsequence(const handle_t& handle, size_t index, size_t size) const;
+    /// Append the sequence of a handle, in the orientation of the handle, to
+    /// seq without building a temporary string.
+    void append_sequence(const handle_t& handle, std::string& seq) const;
+    /// Append a substring of a handle's sequence, as get_subsequence would
+    /// return it, to seq.
+    void append_subsequence(const handle_t& handle, size_t index, size_t size, std::string& seq) const;
+    /// Append the sequence spelled by the steps from begin up to, but not
+    /// including, end to seq. Callers that know the length should reserve it.
+    void append_path_range_sequence(const step_handle_t& begin, const step_handle_t& end, std::string& seq) const;
     
     // TODO: There's currently no really good efficient way to implement
     // get_degree; we have to decode each edge to work out what node side it is
@@ -406,6 +419,9 @@ public:
     pos_t graph_pos_at_path_position(const std::string& name, size_t path_pos) const;
     char pos_char(nid_t id, bool is_rev, size_t off) const;
     std::string pos_substr(nid_t id, bool is_rev, size_t off, size_t len) const;
+    /// Decode length bases of s_iv starting at start into out, reverse
+    /// complemented when is_rev, unpacking a machine word at a time.
+    void decode_sequence(size_t start, size_t length, bool is_rev, char* out) const;
     size_t edge_index(const edge_t& edge) const;
     size_t get_g_iv_size(void) const;
 
@@ -481,7 +497,7 @@ private:
     
     // Use memmapped indexing to construct the node-to-path indexes once
     // XGPath's have been created (used during construction)
-    void index_node_to_path(const std::string& basename);
+    void index_node_to_path(const std::string& basename, uint64_t num_threads = 0);
     
     void print_graph() const;
     
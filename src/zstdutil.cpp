@@ -10,14 +10,70 @@
 
 #include "zstdutil.hpp"
 
+#include <zdict.h>
+
 namespace zstdutil {
 
+namespace {
+
+// contexts are expensive to set up, so each thread keeps its own for the one-shot calls
+struct ThreadContexts {
+  ZSTD_CCtx* cctx = nullptr;
+  ZSTD_DCtx* dctx = nullptr;
+  ~ThreadContexts() {
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+  }
+};
+
+thread_local ThreadContexts thread_contexts;
+
+ZSTD_CCtx* ThreadCCtx() {
+  if (thread_contexts.cctx == nullptr) {
+    thread_contexts.cctx = ZSTD_createCCtx();
+  }
+  return thread_contexts.cctx;
+}
+
+ZSTD_DCtx* ThreadDCtx() {
+  if (thread_contexts.dctx == nullptr) {
+    thread_contexts.dctx = ZSTD_createDCtx();
+  }
+  return thread_contexts.dctx;
+}
+
+}  // namespace
+
+Dictionary::Dictionary(const std::vector<std::string>& samples, size_t capacity, int compressionlevel) {
+  std::string buffer;
+  std::vector<size_t> sizes;
+  sizes.reserve(samples.size());
+  for (auto& sample : samples) {
+    buffer.append(sample);
+    sizes.push_back(sample.size());
+  }
+  std::string dict(capacity, '\0');
+  size_t const dSize = ZDICT_trainFromBuffer(&dict[0], capacity,
+                                             buffer.data(), sizes.data(), (unsigned)sizes.size());
+  if (ZDICT_isError(dSize)) {
+    return;
+  }
+  cdict_ = ZSTD_createCDict(dict.data(), dSize, compressionlevel);
+  ddict_ = ZSTD_createDDict(dict.data(), dSize);
+  id_ = ZDICT_getDictID(dict.data(), dSize);
+}
+
+Dictionary::~Dictionary() {
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+}
+
 int CompressString(const std::string& src, std::string& dst, int compressionlevel) {
   size_t const cBuffSize = ZSTD_compressBound(src.size());
   dst.resize(cBuffSize);
   auto dstp = const_cast<void*>(static_cast<const void*>(dst.c_str()));
   auto srcp = static_cast<const void*>(src.c_str());
-  size_t const cSize = ZSTD_compress(dstp, cBuffSize, srcp, src.size(), compressionlevel);
+  size_t const cSize = ZSTD_compressCCtx(ThreadCCtx(), dstp, cBuffSize, srcp, src.size(), compressionlevel);
   auto code = ZSTD_isError(cSize);
   if (code) {
     return code;
@@ -44,7 +100,50 @@ int DecompressString(const std::string& src, std::string& dst) {
   dst.resize(cBuffSize);
   auto dstp = const_cast<void*>(static_cast<const void*>(dst.c_str()));
   auto srcp = static_cast<const void*>(src.c_str());
-  size_t const cSize = ZSTD_decompress(dstp, cBuffSize, srcp, src.size());
+  size_t const cSize = ZSTD_decompressDCtx(ThreadDCtx(), dstp, cBuffSize, srcp, src.size());
+  auto code = ZSTD_isError(cSize);
+  if (code) {
+    return code;
+  }
+  dst.resize(cSize);
+  return code;
+}
+
+int CompressString(const std::string& src, std::string& dst, const Dictionary& dict) {
+  if (!dict.ok()) {
+    return CompressString(src, dst);
+  }
+  size_t const cBuffSize = ZSTD_compressBound(src.size());
+  dst.resize(cBuffSize);
+  auto dstp = const_cast<void*>(static_cast<const void*>(dst.c_str()));
+  auto srcp = static_cast<const void*>(src.c_str());
+  size_t const cSize = ZSTD_compress_usingCDict(ThreadCCtx(), dstp, cBuffSize, srcp, src.size(), dict.cdict());
+  auto code = ZSTD_isError(cSize);
+  if (code) {
+    return code;
+  }
+  dst.resize(cSize);
+  return code;
+}
+
+int DecompressString(const std::string& src, std::string& dst, const Dictionary& dict) {
+  if (!dict.ok() || ZSTD_getDictID_fromFrame(src.c_str(), src.size()) != dict.id()) {
+    return DecompressString(src, dst);
+  }
+  size_t const cBuffSize = ZSTD_getFrameContentSize(src.c_str(), src.size());
+
+  if (0 == cBuffSize) {
+    return cBuffSize;
+  }
+
+  if (ZSTD_CONTENTSIZE_UNKNOWN == cBuffSize || ZSTD_CONTENTSIZE_ERROR == cBuffSize) {
+    return -2;
+  }
+
+  dst.resize(cBuffSize);
+  auto dstp = const_cast<void*>(static_cast<const void*>(dst.c_str()));
+  auto srcp = static_cast<const void*>(src.c_str());
+  size_t const cSize = ZSTD_decompress_usingDDict(ThreadDCtx(), dstp, cBuffSize, srcp, src.size(), dict.ddict());
   auto code = ZSTD_isError(cSize);
   if (code) {
     return code;
@@ -11,11 +11,37 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <zstd.h>
 
 namespace zstdutil {
 
 const int DEFAULTCOMPRESSLEVEL = 5;
+const size_t DEFAULTDICTCAPACITY = 112640;
+
+// A dictionary trained on sample inputs, digested once for compression and
+// decompression so it can be shared by all threads.
+class Dictionary {
+ public:
+  Dictionary(const std::vector<std::string>& samples,
+             size_t capacity = DEFAULTDICTCAPACITY,
+             int compressionlevel = DEFAULTCOMPRESSLEVEL);
+  ~Dictionary();
+  Dictionary(const Dictionary&) = delete;
+  Dictionary& operator=(const Dictionary&) = delete;
+
+  // false if training failed, e.g. because there were too few samples
+  bool ok() const { return cdict_ != nullptr && ddict_ != nullptr; }
+  unsigned id() const { return id_; }
+
+  const ZSTD_CDict* cdict() const { return cdict_; }
+  const ZSTD_DDict* ddict() const { return ddict_; }
+
+ private:
+  ZSTD_CDict* cdict_ = nullptr;
+  ZSTD_DDict* ddict_ = nullptr;
+  unsigned id_ = 0;
+};
 
 // if return code not 0 is error
 int CompressString(const std::string& src, std::string& dst,
@@ -24,6 +50,13 @@ int CompressString(const std::string& src, std::string& dst,
 // if return code not 0 is error
 int DecompressString(const std::string& src, std::string& dst);
 
+// if return code not 0 is error
+int CompressString(const std::string& src, std::string& dst, const Dictionary& dict);
+
+// frames written without the dictionary are decompressed without it
+// if return code not 0 is error
+int DecompressString(const std::string& src, std::string& dst, const Dictionary& dict);
+
 // if return code not 0 is error
 int StreamDecompressString(const std::string& src, std::string& dst,
                            int compressionlevel = DEFAULTCOMPRESSLEVEL);